@@ -0,0 +1,54 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_ATOMIC_H_
+#define RESMAN_ATOMIC_H_
+
+/* the few atomic operations needed by the lock-free parts of resman. Compare
+ * and swap and exchange are full barriers, loads have acquire semantics, and
+ * stores have release semantics.
+ */
+#if defined(_MSC_VER)
+#include <windows.h>
+#define cas_ptr(p, oldval, newval) \
+	(InterlockedCompareExchangePointer((void*volatile*)(p), newval, oldval) == (oldval))
+#define xchg_ptr(p, val) \
+	InterlockedExchangePointer((void*volatile*)(p), val)
+#define load_ptr(p)	(*(p))	/* volatile reads have acquire semantics on msvc */
+
+#define cas_int(p, oldval, newval) \
+	(InterlockedCompareExchange((volatile LONG*)(p), newval, oldval) == (oldval))
+#define load_int(p)	(*(volatile int*)(p))
+#define store_int(p, val) \
+	InterlockedExchange((volatile LONG*)(p), val)
+#else
+#define cas_ptr(p, oldval, newval) \
+	__sync_bool_compare_and_swap(p, oldval, newval)
+#define xchg_ptr(p, val) \
+	__atomic_exchange_n(p, val, __ATOMIC_ACQ_REL)
+#define load_ptr(p) \
+	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+
+#define cas_int(p, oldval, newval) \
+	__sync_bool_compare_and_swap(p, oldval, newval)
+#define load_int(p) \
+	__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_int(p, val) \
+	__atomic_store_n(p, val, __ATOMIC_RELEASE)
+#endif
+
+#endif	/* RESMAN_ATOMIC_H_ */
@@ -0,0 +1,377 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* persistent on-disk cache of processed resource data */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "hash.h"
+
+#if defined(WIN32) || defined(__WIN32__)
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#include <sys/utime.h>
+#define fsync(fd)	_commit(fd)
+#define mkdir(path, mode)	_mkdir(path)
+#define getpid()	_getpid()
+#else
+#include <unistd.h>
+#include <utime.h>
+#endif
+
+#define CACHE_MAGIC			"RMCACHE1"
+#define CACHE_MAGIC_SIZE	8
+#define CACHE_DATA_ALIGN	16
+#define CACHE_SUFFIX		".rmc"
+#define TMP_SUFFIX			".tmp"
+
+/* every cache entry is a file: header, source name, padding, data */
+struct cache_header {
+	char magic[CACHE_MAGIC_SIZE];
+	struct file_sig sig;
+	uint64_t data_offs;
+	uint64_t data_size;
+	uint32_t name_len;
+	uint32_t unused;
+};
+
+struct cache {
+	char *dir;
+	uint64_t max_size;
+	uint64_t total_size;	/* sum of all entry file sizes */
+
+	unsigned int tmp_count;
+	pthread_mutex_t lock;
+};
+
+struct cache_file {
+	char *name;
+	uint64_t size;
+	time_t mtime;
+};
+
+static char *entry_path(struct cache *cache, const char *name, const char *suffix);
+static int scan_dir(struct cache *cache, struct cache_file **flist, int rm_tmp);
+static void trim(struct cache *cache);
+static int has_suffix(const char *s, const char *suffix);
+static int cmp_mtime(const void *a, const void *b);
+static int replace_file(const char *src, const char *dest);
+
+
+struct cache *resman_cache_open(const char *dir, uint64_t max_size)
+{
+	int i, num;
+	struct cache *cache;
+	struct cache_file *flist;
+	struct stat st;
+
+	if(stat(dir, &st) == -1) {
+		if(mkdir(dir, 0775) == -1) {
+			fprintf(stderr, "resman: failed to create cache directory: %s: %s\n", dir, strerror(errno));
+			return 0;
+		}
+	} else if(!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "resman: cache path is not a directory: %s\n", dir);
+		return 0;
+	}
+
+	if(!(cache = calloc(1, sizeof *cache))) {
+		return 0;
+	}
+	if(!(cache->dir = strdup(dir))) {
+		free(cache);
+		return 0;
+	}
+	cache->max_size = max_size;
+	pthread_mutex_init(&cache->lock, 0);
+
+	/* also clean up any temporary files left over by crashes */
+	if((num = scan_dir(cache, &flist, 1)) > 0) {
+		for(i=0; i<num; i++) {
+			cache->total_size += flist[i].size;
+			free(flist[i].name);
+		}
+		free(flist);
+	}
+
+	if(cache->max_size && cache->total_size > cache->max_size) {
+		trim(cache);
+	}
+	return cache;
+}
+
+void resman_cache_close(struct cache *cache)
+{
+	if(!cache) return;
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->dir);
+	free(cache);
+}
+
+const void *resman_cache_get(struct cache *cache, const char *name,
+		const struct file_sig *sig, struct mapping *map, unsigned long *size)
+{
+	char *path;
+	struct cache_header *hdr;
+	uint32_t name_len = strlen(name);
+
+	if(!(path = entry_path(cache, name, CACHE_SUFFIX))) {
+		return 0;
+	}
+	if(resman_map_file(map, path) == -1) {
+		free(path);
+		return 0;
+	}
+
+	hdr = (struct cache_header*)map->data;
+	if(map->size < sizeof *hdr || memcmp(hdr->magic, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0 ||
+			hdr->name_len != name_len || sizeof *hdr + name_len > map->size ||
+			memcmp(map->data + sizeof *hdr, name, name_len) != 0) {
+		goto miss;
+	}
+	if(hdr->data_offs > map->size || hdr->data_size > map->size - hdr->data_offs) {
+		goto miss;
+	}
+	if(hdr->sig.size != sig->size || hdr->sig.mtime != sig->mtime || hdr->sig.hash != sig->hash) {
+		goto miss;	/* stale entry, will be replaced by the next put */
+	}
+
+	/* bump the modification time, for LRU trimming */
+	utime(path, 0);
+	free(path);
+
+	*size = hdr->data_size;
+	return map->data + hdr->data_offs;
+
+miss:
+	resman_unmap_file(map);
+	free(path);
+	return 0;
+}
+
+int resman_cache_put(struct cache *cache, const char *name,
+		const struct file_sig *sig, const void *data, unsigned long size)
+{
+	FILE *fp;
+	char *path, *tmppath;
+	char suffix[64];
+	static const char zeros[CACHE_DATA_ALIGN];
+	struct cache_header hdr;
+	struct stat st;
+	uint64_t pad, prev_size = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	sprintf(suffix, ".%lu.%u" TMP_SUFFIX, (unsigned long)getpid(), cache->tmp_count++);
+	pthread_mutex_unlock(&cache->lock);
+
+	if(!(path = entry_path(cache, name, CACHE_SUFFIX))) {
+		return -1;
+	}
+	if(!(tmppath = entry_path(cache, name, suffix))) {
+		free(path);
+		return -1;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+	hdr.sig = *sig;
+	hdr.name_len = strlen(name);
+	hdr.data_offs = (sizeof hdr + hdr.name_len + CACHE_DATA_ALIGN - 1) & ~(uint64_t)(CACHE_DATA_ALIGN - 1);
+	hdr.data_size = size;
+	pad = hdr.data_offs - sizeof hdr - hdr.name_len;
+
+	if(!(fp = fopen(tmppath, "wb"))) {
+		goto err;
+	}
+	if(fwrite(&hdr, sizeof hdr, 1, fp) < 1 || fwrite(name, 1, hdr.name_len, fp) < hdr.name_len ||
+			fwrite(zeros, 1, pad, fp) < pad || fwrite(data, 1, size, fp) < size) {
+		fclose(fp);
+		goto err;
+	}
+	/* make sure the data hit the disk before the rename makes them visible */
+	if(fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+		fclose(fp);
+		goto err;
+	}
+	if(fclose(fp) == EOF) {
+		goto err;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	if(stat(path, &st) == 0) {
+		prev_size = st.st_size;
+	}
+	if(replace_file(tmppath, path) == -1) {
+		pthread_mutex_unlock(&cache->lock);
+		goto err;
+	}
+	cache->total_size += hdr.data_offs + size - prev_size;
+
+	if(cache->max_size && cache->total_size > cache->max_size) {
+		trim(cache);
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	free(tmppath);
+	free(path);
+	return 0;
+
+err:
+	fprintf(stderr, "resman: failed to write cache entry for %s: %s\n", name, strerror(errno));
+	remove(tmppath);
+	free(tmppath);
+	free(path);
+	return -1;
+}
+
+/* entry filenames are derived from the hash of the resource name */
+static char *entry_path(struct cache *cache, const char *name, const char *suffix)
+{
+	char *path;
+	uint64_t hash = resman_hash(name, strlen(name), 0);
+
+	if(!(path = malloc(strlen(cache->dir) + strlen(suffix) + 18))) {
+		return 0;
+	}
+	sprintf(path, "%s/%08lx%08lx%s", cache->dir, (unsigned long)(hash >> 32),
+			(unsigned long)(hash & 0xffffffff), suffix);
+	return path;
+}
+
+/* returns a list of all the cache entries, and optionally removes any stray
+ * temporary files. Returns the number of entries, or -1 on failure.
+ */
+static int scan_dir(struct cache *cache, struct cache_file **flist, int rm_tmp)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	struct cache_file *list = 0, *tmp;
+	int num = 0, max = 0;
+	char *path;
+
+	if(!(dir = opendir(cache->dir))) {
+		return -1;
+	}
+	while((dent = readdir(dir))) {
+		int is_tmp = has_suffix(dent->d_name, TMP_SUFFIX);
+		if(!is_tmp && !has_suffix(dent->d_name, CACHE_SUFFIX)) {
+			continue;
+		}
+		if(!(path = malloc(strlen(cache->dir) + strlen(dent->d_name) + 2))) {
+			break;
+		}
+		sprintf(path, "%s/%s", cache->dir, dent->d_name);
+
+		if(is_tmp) {
+			if(rm_tmp) {
+				remove(path);
+			}
+			free(path);
+			continue;
+		}
+		if(stat(path, &st) == -1) {
+			free(path);
+			continue;
+		}
+
+		if(num >= max) {
+			int newsz = max ? max * 2 : 64;
+			if(!(tmp = realloc(list, newsz * sizeof *list))) {
+				free(path);
+				break;
+			}
+			list = tmp;
+			max = newsz;
+		}
+		list[num].name = path;
+		list[num].size = st.st_size;
+		list[num].mtime = st.st_mtime;
+		num++;
+	}
+	closedir(dir);
+
+	*flist = list;
+	return num;
+}
+
+/* delete least recently used entries, until we're comfortably under the
+ * size limit. Called with the cache lock held.
+ */
+static void trim(struct cache *cache)
+{
+	int i, num;
+	struct cache_file *flist;
+	uint64_t target = cache->max_size - cache->max_size / 8;
+
+	if((num = scan_dir(cache, &flist, 0)) <= 0) {
+		return;
+	}
+	qsort(flist, num, sizeof *flist, cmp_mtime);
+
+	cache->total_size = 0;
+	for(i=0; i<num; i++) {
+		cache->total_size += flist[i].size;
+	}
+
+	for(i=0; i<num && cache->total_size > target; i++) {
+		if(remove(flist[i].name) == 0) {
+			cache->total_size -= flist[i].size;
+		}
+	}
+
+	for(i=0; i<num; i++) {
+		free(flist[i].name);
+	}
+	free(flist);
+}
+
+static int has_suffix(const char *s, const char *suffix)
+{
+	int len = strlen(s);
+	int slen = strlen(suffix);
+	return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+static int cmp_mtime(const void *a, const void *b)
+{
+	const struct cache_file *fa = a;
+	const struct cache_file *fb = b;
+	return fa->mtime < fb->mtime ? -1 : (fa->mtime > fb->mtime ? 1 : 0);
+}
+
+#if defined(WIN32) || defined(__WIN32__)
+static int replace_file(const char *src, const char *dest)
+{
+	if(!MoveFileEx(src, dest, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+		return -1;
+	}
+	return 0;
+}
+#else
+static int replace_file(const char *src, const char *dest)
+{
+	return rename(src, dest);
+}
+#endif
@@ -0,0 +1,52 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_CACHE_H_
+#define RESMAN_CACHE_H_
+
+#include <stdint.h>
+#include "mapfile.h"
+
+/* identifies a specific version of a source file */
+struct file_sig {
+	uint64_t size;
+	int64_t mtime;
+	uint64_t hash;		/* content hash */
+};
+
+struct cache;
+
+/* open (or create) a cache directory. max_size is the size cap in bytes (0 for
+ * no limit). Least recently used entries are deleted when it's exceeded.
+ */
+struct cache *resman_cache_open(const char *dir, uint64_t max_size);
+void resman_cache_close(struct cache *cache);
+
+/* map the cached data for name, if they were stored from a source file with a
+ * matching signature. Returns the data pointer, or null on cache miss. The
+ * mapping must be released with resman_unmap_file.
+ */
+const void *resman_cache_get(struct cache *cache, const char *name,
+		const struct file_sig *sig, struct mapping *map, unsigned long *size);
+
+/* store data in the cache. The entry is written to a temporary file and then
+ * atomically renamed into place, so a crash never leaves a partial entry.
+ */
+int resman_cache_put(struct cache *cache, const char *name,
+		const struct file_sig *sig, const void *data, unsigned long size);
+
+#endif	/* RESMAN_CACHE_H_ */
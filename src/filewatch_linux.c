@@ -71,7 +71,7 @@ int resman_start_watch(struct resman *rman, struct resource *res)
 		return 0;	/* already started a watch for this resource */
 	}
 
-	if((fd = inotify_add_watch(rman->inotify_fd, res->name, IN_MODIFY)) == -1) {
+	if((fd = inotify_add_watch(rman->inotify_fd, res->name, IN_MODIFY | IN_CLOSE_WRITE)) == -1) {
 		return -1;
 	}
 	printf("started watching file \"%s\" for modification (fd %d)\n", res->name, fd);
@@ -108,7 +108,7 @@ void resman_check_watch(struct resman *rman)
 				 * wait for IN_CLOSE_WRITE instead.
 				 */
 				if((res = rb_findi(rman->nresmap, ev->wd))) {
-					res->reload_timeout = msec + 128;
+					RES_RELOAD_TIMEOUT(res) = msec + 128;
 				}
 			}
 
@@ -116,7 +116,7 @@ void resman_check_watch(struct resman *rman)
 				if((res = rb_findi(rman->nresmap, ev->wd))) {
 					/* add the file descriptor to the modified set */
 					rb_inserti(rman->modset, ev->wd, 0);
-					res->reload_timeout = 0;	/* cancel any delayed reloads */
+					RES_RELOAD_TIMEOUT(res) = 0;	/* cancel any delayed reloads */
 				}
 			}
 
@@ -147,7 +147,7 @@ void resman_check_watch(struct resman *rman)
 
 			evsize = sizeof *ev + ev->len;
 			sz -= evsize;
-			ev += evsize;
+			ev = (struct inotify_event*)((char*)ev + evsize);
 		}
 	}
 
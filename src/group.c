@@ -0,0 +1,197 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* resource groups: sets of resources loaded, waited for, and unloaded together */
+#include <stdio.h>
+#include <stdlib.h>
+#include "resman.h"
+#include "resman_impl.h"
+#include "dynarr.h"
+#include "atomic.h"
+
+struct group_member {
+	int id;
+	const char *name;	/* to notice if the id was reused by another resource */
+};
+
+struct res_group {
+	struct group_member *members;	/* dynamic array */
+};
+
+static struct res_group *get_group(struct resman *rman, int group);
+static struct resource *get_member(struct resman *rman, struct group_member *m);
+
+
+void resman_destroy_groups(struct resman *rman)
+{
+	int i;
+
+	if(!rman->groups) return;
+
+	for(i=0; i<dynarr_size(rman->groups); i++) {
+		if(rman->groups[i]) {
+			dynarr_free(rman->groups[i]->members);
+			free(rman->groups[i]);
+		}
+	}
+	dynarr_free(rman->groups);
+	rman->groups = 0;
+}
+
+int resman_create_group(struct resman *rman)
+{
+	int i;
+	struct res_group *grp, **tmp;
+
+	if(!(grp = malloc(sizeof *grp))) {
+		return -1;
+	}
+	if(!(grp->members = dynarr_alloc(0, sizeof *grp->members))) {
+		free(grp);
+		return -1;
+	}
+
+	/* reuse the slot of an unloaded group if possible */
+	for(i=0; i<dynarr_size(rman->groups); i++) {
+		if(!rman->groups[i]) {
+			rman->groups[i] = grp;
+			return i;
+		}
+	}
+	if(!(tmp = dynarr_push(rman->groups, &grp))) {
+		dynarr_free(grp->members);
+		free(grp);
+		return -1;
+	}
+	rman->groups = tmp;
+	return dynarr_size(rman->groups) - 1;
+}
+
+int resman_group_add(struct resman *rman, int group, const char *fname, void *data)
+{
+	int id;
+	struct res_group *grp;
+	struct resource *res;
+	struct group_member m, *tmp;
+
+	if(!(grp = get_group(rman, group)) || (id = resman_add(rman, fname, data)) == -1) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&rman->res_lock);
+	if((res = resman_get_res(rman, id))) {
+		m.id = id;
+		m.name = res->name;
+		if((tmp = dynarr_push(grp->members, &m))) {
+			grp->members = tmp;
+			res->num_groups++;
+		} else {
+			id = -1;
+		}
+	} else {
+		id = -1;
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+	return id;
+}
+
+void resman_group_wait(struct resman *rman, int group)
+{
+	int i;
+	struct res_group *grp;
+
+	if(!(grp = get_group(rman, group))) {
+		return;
+	}
+	/* a single pass is enough, members which are already loaded stay loaded */
+	for(i=0; i<dynarr_size(grp->members); i++) {
+		if(get_member(rman, grp->members + i)) {
+			resman_wait_job(rman, grp->members[i].id);
+		}
+	}
+}
+
+int resman_group_progress(struct resman *rman, int group, int *total)
+{
+	int i, st, num, done = 0;
+	struct res_group *grp;
+	struct resource *res;
+
+	if(!(grp = get_group(rman, group))) {
+		return -1;
+	}
+	num = dynarr_size(grp->members);
+	for(i=0; i<num; i++) {
+		/* resources removed after failing to load are finished too */
+		if(!(res = get_member(rman, grp->members + i))) {
+			done++;
+			continue;
+		}
+		st = load_int(&RES_STATE(res)) & RES_STATE_MASK;
+		if(st == RES_DONE || st == RES_DELETING) {
+			done++;
+		}
+	}
+
+	if(total) {
+		*total = num;
+	}
+	return done;
+}
+
+void resman_group_unload(struct resman *rman, int group)
+{
+	int i;
+	struct res_group *grp;
+	struct resource *res;
+
+	if(!(grp = get_group(rman, group))) {
+		return;
+	}
+
+	/* only queue them up for deletion, resman_poll will remove them a few at
+	 * a time, within its timeslice.
+	 */
+	pthread_mutex_lock(&rman->res_lock);
+	for(i=0; i<dynarr_size(grp->members); i++) {
+		if(!(res = get_member(rman, grp->members + i)) || res->num_groups <= 0) {
+			continue;
+		}
+		if(--res->num_groups == 0) {
+			resman_queue_delete(rman, res);
+		}
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+
+	dynarr_free(grp->members);
+	free(grp);
+	rman->groups[group] = 0;
+}
+
+static struct res_group *get_group(struct resman *rman, int group)
+{
+	if(group < 0 || group >= dynarr_size(rman->groups)) {
+		return 0;
+	}
+	return rman->groups[group];
+}
+
+static struct resource *get_member(struct resman *rman, struct group_member *m)
+{
+	struct resource *res = resman_get_res(rman, m->id);
+	return res && res->name == m->name ? res : 0;
+}
@@ -0,0 +1,203 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+
+#define P1	0x9e3779b185ebca87ULL
+#define P2	0xc2b2ae3d27d4eb4fULL
+#define P3	0x165667b19e3779f9ULL
+#define P4	0x85ebca77c2b2ae63ULL
+#define P5	0x27d4eb2f165667c5ULL
+
+#define ROTL(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t round64(uint64_t acc, uint64_t in);
+static uint64_t merge_round(uint64_t acc, uint64_t val);
+static uint64_t read64(const unsigned char *p);
+static uint32_t read32(const unsigned char *p);
+static const unsigned char *process_stripes(uint64_t *v, const unsigned char *p, const unsigned char *end);
+static uint64_t finalize(uint64_t h, const unsigned char *p, size_t len);
+
+
+uint64_t resman_hash(const void *data, size_t size, uint64_t seed)
+{
+	struct hash_state hs;
+
+	resman_hash_init(&hs, seed);
+	resman_hash_update(&hs, data, size);
+	return resman_hash_final(&hs);
+}
+
+void resman_hash_init(struct hash_state *hs, uint64_t seed)
+{
+	hs->seed = seed;
+	hs->v[0] = seed + P1 + P2;
+	hs->v[1] = seed + P2;
+	hs->v[2] = seed;
+	hs->v[3] = seed - P1;
+	hs->total = 0;
+	hs->bufsz = 0;
+}
+
+void resman_hash_update(struct hash_state *hs, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + size;
+
+	hs->total += size;
+
+	if(hs->bufsz + size < 32) {
+		memcpy(hs->buf + hs->bufsz, p, size);
+		hs->bufsz += size;
+		return;
+	}
+
+	if(hs->bufsz) {
+		int sz = 32 - hs->bufsz;
+		memcpy(hs->buf + hs->bufsz, p, sz);
+		process_stripes(hs->v, hs->buf, hs->buf + 32);
+		p += sz;
+		hs->bufsz = 0;
+	}
+
+	p = process_stripes(hs->v, p, end);
+
+	if(p < end) {
+		hs->bufsz = end - p;
+		memcpy(hs->buf, p, hs->bufsz);
+	}
+}
+
+uint64_t resman_hash_final(struct hash_state *hs)
+{
+	uint64_t h;
+	uint64_t *v = hs->v;
+
+	if(hs->total >= 32) {
+		h = ROTL(v[0], 1) + ROTL(v[1], 7) + ROTL(v[2], 12) + ROTL(v[3], 18);
+		h = merge_round(h, v[0]);
+		h = merge_round(h, v[1]);
+		h = merge_round(h, v[2]);
+		h = merge_round(h, v[3]);
+	} else {
+		h = hs->seed + P5;
+	}
+	h += hs->total;
+
+	return finalize(h, hs->buf, hs->bufsz);
+}
+
+int resman_hash_file(const char *fname, uint64_t *hash)
+{
+	FILE *fp;
+	size_t sz;
+	struct hash_state hs;
+	unsigned char buf[65536];
+
+	if(!(fp = fopen(fname, "rb"))) {
+		return -1;
+	}
+
+	resman_hash_init(&hs, 0);
+	while((sz = fread(buf, 1, sizeof buf, fp)) > 0) {
+		resman_hash_update(&hs, buf, sz);
+	}
+	if(ferror(fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	*hash = resman_hash_final(&hs);
+	return 0;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t in)
+{
+	acc += in * P2;
+	acc = ROTL(acc, 31);
+	return acc * P1;
+}
+
+static uint64_t merge_round(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0, val);
+	return acc * P1 + P4;
+}
+
+/* always little-endian, so hashes are the same across platforms */
+static uint64_t read64(const unsigned char *p)
+{
+	return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* the four accumulators are independent, which lets the compiler keep them
+ * all in flight at once (or vectorize them).
+ */
+static const unsigned char *process_stripes(uint64_t *v, const unsigned char *p, const unsigned char *end)
+{
+	uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+	while(end - p >= 32) {
+		v0 = round64(v0, read64(p));
+		v1 = round64(v1, read64(p + 8));
+		v2 = round64(v2, read64(p + 16));
+		v3 = round64(v3, read64(p + 24));
+		p += 32;
+	}
+
+	v[0] = v0;
+	v[1] = v1;
+	v[2] = v2;
+	v[3] = v3;
+	return p;
+}
+
+static uint64_t finalize(uint64_t h, const unsigned char *p, size_t len)
+{
+	while(len >= 8) {
+		h ^= round64(0, read64(p));
+		h = ROTL(h, 27) * P1 + P4;
+		p += 8;
+		len -= 8;
+	}
+	if(len >= 4) {
+		h ^= (uint64_t)read32(p) * P1;
+		h = ROTL(h, 23) * P2 + P3;
+		p += 4;
+		len -= 4;
+	}
+	while(len > 0) {
+		h ^= (*p++) * P5;
+		h = ROTL(h, 11) * P1;
+		len--;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
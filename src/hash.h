@@ -0,0 +1,44 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_HASH_H_
+#define RESMAN_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 64bit content hash, compatible with XXH64. Processes input in four
+ * independent lanes, so it runs close to memory bandwidth.
+ */
+struct hash_state {
+	uint64_t v[4];
+	uint64_t seed, total;
+	unsigned char buf[32];
+	int bufsz;
+};
+
+uint64_t resman_hash(const void *data, size_t size, uint64_t seed);
+
+/* incremental interface, for hashing files in chunks */
+void resman_hash_init(struct hash_state *hs, uint64_t seed);
+void resman_hash_update(struct hash_state *hs, const void *data, size_t size);
+uint64_t resman_hash_final(struct hash_state *hs);
+
+/* hash the contents of a file. Returns 0 on success, -1 on failure */
+int resman_hash_file(const char *fname, uint64_t *hash);
+
+#endif	/* RESMAN_HASH_H_ */
@@ -0,0 +1,97 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include "mapfile.h"
+
+#if !defined(WIN32) && !defined(__WIN32__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+#if defined(WIN32) || defined(__WIN32__)
+int resman_map_file(struct mapping *m, const char *fname)
+{
+	LARGE_INTEGER sz;
+
+	m->file = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, 0, 0);
+	if(m->file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	if(!GetFileSizeEx(m->file, &sz) || sz.QuadPart == 0) {
+		CloseHandle(m->file);
+		return -1;
+	}
+	m->size = sz.QuadPart;
+
+	if(!(m->mapping = CreateFileMapping(m->file, 0, PAGE_READONLY, 0, 0, 0))) {
+		CloseHandle(m->file);
+		return -1;
+	}
+	if(!(m->data = MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0))) {
+		CloseHandle(m->mapping);
+		CloseHandle(m->file);
+		return -1;
+	}
+	return 0;
+}
+
+void resman_unmap_file(struct mapping *m)
+{
+	if(m->data) {
+		UnmapViewOfFile(m->data);
+		CloseHandle(m->mapping);
+		CloseHandle(m->file);
+		m->data = 0;
+	}
+}
+
+#else	/* UNIX */
+int resman_map_file(struct mapping *m, const char *fname)
+{
+	int fd;
+	struct stat st;
+	void *map;
+
+	if((fd = open(fname, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || st.st_size <= 0) {
+		close(fd);
+		return -1;
+	}
+	m->size = st.st_size;
+
+	map = mmap(0, m->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		return -1;
+	}
+	m->data = map;
+	return 0;
+}
+
+void resman_unmap_file(struct mapping *m)
+{
+	if(m->data) {
+		munmap(m->data, m->size);
+		m->data = 0;
+	}
+}
+#endif	/* WIN32/UNIX */
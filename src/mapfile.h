@@ -0,0 +1,40 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_MAPFILE_H_
+#define RESMAN_MAPFILE_H_
+
+#include <stdint.h>
+
+#if defined(WIN32) || defined(__WIN32__)
+#include <windows.h>
+#endif
+
+/* read-only memory mapping of a whole file */
+struct mapping {
+	unsigned char *data;
+	uint64_t size;
+
+#if defined(WIN32) || defined(__WIN32__)
+	HANDLE file, mapping;
+#endif
+};
+
+int resman_map_file(struct mapping *m, const char *fname);
+void resman_unmap_file(struct mapping *m);
+
+#endif	/* RESMAN_MAPFILE_H_ */
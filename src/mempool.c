@@ -0,0 +1,188 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* lock-free fixed-size object allocator with per-thread caches */
+#include <stdio.h>
+#include <stdlib.h>
+#include "mempool.h"
+#include "atomic.h"
+
+#define SLAB_OBJS	64
+#define MAX_CACHED	256
+
+/* free objects are linked through their first word */
+struct node {
+	struct node *next;
+};
+
+struct cache {
+	struct mempool *mp;
+	struct node *head, *tail;
+	int count;
+};
+
+static struct cache *get_cache(struct mempool *mp);
+static void flush_cache(struct cache *cache);
+static void destroy_cache(void *cls);
+static int alloc_slab(struct mempool *mp, struct cache *cache);
+
+
+int resman_mempool_init(struct mempool *mp, unsigned long obj_size)
+{
+	if(obj_size < sizeof(struct node)) {
+		obj_size = sizeof(struct node);
+	}
+	mp->obj_size = (obj_size + sizeof(void*) - 1) & ~(unsigned long)(sizeof(void*) - 1);
+	mp->slab_objs = SLAB_OBJS;
+	mp->max_cached = MAX_CACHED;
+	mp->free_list = 0;
+	mp->slabs = 0;
+
+	if(pthread_key_create(&mp->cache_key, destroy_cache) != 0) {
+		return -1;
+	}
+	pthread_mutex_init(&mp->slab_lock, 0);
+	return 0;
+}
+
+void *resman_mempool_alloc(struct mempool *mp)
+{
+	struct node *n;
+	struct cache *cache;
+
+	if(!(cache = get_cache(mp))) {
+		return malloc(mp->obj_size);	/* no cache, can only happen when out of memory */
+	}
+
+	if(!cache->head) {
+		/* take over the whole global free list. Popping everything at once
+		 * doesn't suffer from the ABA problem of popping single nodes.
+		 */
+		if((n = xchg_ptr(&mp->free_list, 0))) {
+			cache->head = n;
+			cache->count = 1;
+			while(n->next) {
+				n = n->next;
+				cache->count++;
+			}
+			cache->tail = n;
+		} else if(alloc_slab(mp, cache) == -1) {
+			return 0;
+		}
+	}
+
+	n = cache->head;
+	if(!(cache->head = n->next)) {
+		cache->tail = 0;
+	}
+	cache->count--;
+	return n;
+}
+
+void resman_mempool_free(struct mempool *mp, void *obj)
+{
+	struct node *n = obj;
+	struct cache *cache;
+
+	if(!obj) return;
+
+	if(!(cache = get_cache(mp))) {
+		/* can't get rid of it now, leak it rather than free memory in a slab */
+		return;
+	}
+
+	n->next = cache->head;
+	cache->head = n;
+	if(!cache->tail) {
+		cache->tail = n;
+	}
+	if(++cache->count > mp->max_cached) {
+		flush_cache(cache);
+	}
+}
+
+static struct cache *get_cache(struct mempool *mp)
+{
+	struct cache *cache;
+
+	if(!(cache = pthread_getspecific(mp->cache_key))) {
+		if(!(cache = calloc(1, sizeof *cache))) {
+			return 0;
+		}
+		cache->mp = mp;
+		pthread_setspecific(mp->cache_key, cache);
+	}
+	return cache;
+}
+
+/* hand over the whole thread cache to the global free list */
+static void flush_cache(struct cache *cache)
+{
+	struct node *head;
+	struct mempool *mp = cache->mp;
+
+	if(!cache->head) return;
+
+	do {
+		head = load_ptr(&mp->free_list);
+		cache->tail->next = head;
+	} while(!cas_ptr(&mp->free_list, head, cache->head));
+
+	cache->head = cache->tail = 0;
+	cache->count = 0;
+}
+
+/* thread exit: don't lose the objects in the cache of the dying thread */
+static void destroy_cache(void *cls)
+{
+	struct cache *cache = cls;
+
+	flush_cache(cache);
+	free(cache);
+}
+
+/* allocate a new slab, and put all its objects in the thread cache. The first
+ * word of each slab links it to the list of slabs, which keeps them reachable
+ * for leak checkers.
+ */
+static int alloc_slab(struct mempool *mp, struct cache *cache)
+{
+	int i;
+	char *slab, *ptr;
+	unsigned long hdr_size = mp->obj_size;
+
+	if(!(slab = malloc(hdr_size + mp->obj_size * mp->slab_objs))) {
+		return -1;
+	}
+	pthread_mutex_lock(&mp->slab_lock);
+	((struct node*)slab)->next = mp->slabs;
+	mp->slabs = slab;
+	pthread_mutex_unlock(&mp->slab_lock);
+
+	ptr = slab + hdr_size;
+	for(i=0; i<mp->slab_objs; i++) {
+		struct node *n = (struct node*)ptr;
+		n->next = cache->head;
+		cache->head = n;
+		if(!cache->tail) {
+			cache->tail = n;
+		}
+		ptr += mp->obj_size;
+	}
+	cache->count += mp->slab_objs;
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_MEMPOOL_H_
+#define RESMAN_MEMPOOL_H_
+
+#include <pthread.h>
+
+/* fixed-size object allocator for the small structures allocated on every
+ * job. Each thread allocates from, and frees to, its own cache of free
+ * objects, without any locking. Caches which grow too large are handed over
+ * in one go to a lock-free global free list, which threads with an empty cache
+ * take over, again in one go. New objects are carved out of slabs, which are
+ * never returned to the system.
+ */
+struct mempool {
+	unsigned long obj_size;
+	int slab_objs;		/* objects per slab */
+	int max_cached;		/* max objects in each thread cache */
+
+	void *volatile free_list;	/* global free list (lock-free) */
+
+	pthread_key_t cache_key;
+	pthread_mutex_t slab_lock;
+	void *slabs;
+};
+
+int resman_mempool_init(struct mempool *mp, unsigned long obj_size);
+
+void *resman_mempool_alloc(struct mempool *mp);
+void resman_mempool_free(struct mempool *mp, void *obj);
+
+#endif	/* RESMAN_MEMPOOL_H_ */
@@ -0,0 +1,346 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* interned resource names and the sharded name index */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "nameidx.h"
+#include "hash.h"
+
+#if defined(WIN32) || defined(__WIN32__)
+#define IS_SEP(c)	((c) == '/' || (c) == '\\')
+#else
+#define IS_SEP(c)	((c) == '/')
+#endif
+
+#define INIT_BUCKETS	64
+#define BLOCK_SIZE		16384
+
+struct name_entry {
+	struct name_entry *next;
+	uint64_t hash;
+	int id;		/* resource using this name, or -1 */
+	int len;
+	char name[1];
+};
+
+struct name_block {
+	struct name_block *next;
+	int size, used;
+	uint64_t data[1];	/* aligned for the entries stored in it */
+};
+
+#define ENTRY(name)	((struct name_entry*)((name) - offsetof(struct name_entry, name)))
+
+static struct name_shard *find_shard(struct name_index *idx, const char *name, uint64_t *hash);
+static struct name_entry *lookup(struct name_shard *shard, const char *name, uint64_t hash);
+static struct name_entry *intern(struct name_shard *shard, const char *name, uint64_t hash);
+static void *alloc_name(struct name_shard *shard, int size);
+static void grow(struct name_shard *shard);
+
+
+int resman_nameidx_init(struct name_index *idx)
+{
+	int i;
+	struct name_shard *shard;
+
+	memset(idx, 0, sizeof *idx);
+
+	for(i=0; i<NAMEIDX_NUM_SHARDS; i++) {
+		shard = idx->shard + i;
+		if(!(shard->buckets = calloc(INIT_BUCKETS, sizeof *shard->buckets))) {
+			resman_nameidx_destroy(idx);
+			return -1;
+		}
+		shard->num_buckets = INIT_BUCKETS;
+		pthread_mutex_init(&shard->lock, 0);
+	}
+	return 0;
+}
+
+void resman_nameidx_destroy(struct name_index *idx)
+{
+	int i;
+	struct name_shard *shard;
+	struct name_block *blk;
+
+	for(i=0; i<NAMEIDX_NUM_SHARDS; i++) {
+		shard = idx->shard + i;
+		if(!shard->buckets) continue;
+
+		while(shard->blocks) {
+			blk = shard->blocks;
+			shard->blocks = blk->next;
+			free(blk);
+		}
+		free(shard->buckets);
+		shard->buckets = 0;
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+int resman_nameidx_find(struct name_index *idx, const char *name)
+{
+	int id = -1;
+	uint64_t hash;
+	struct name_entry *ent;
+	struct name_shard *shard = find_shard(idx, name, &hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if((ent = lookup(shard, name, hash))) {
+		id = ent->id;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return id;
+}
+
+int resman_nameidx_add(struct name_index *idx, const char *name,
+		resman_nameidx_create_func create, void *cls)
+{
+	int id = -1;
+	uint64_t hash;
+	struct name_entry *ent;
+	struct name_shard *shard = find_shard(idx, name, &hash);
+
+	pthread_mutex_lock(&shard->lock);
+	if((ent = intern(shard, name, hash))) {
+		if(ent->id == -1) {
+			ent->id = create(ent->name, cls);
+		}
+		id = ent->id;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return id;
+}
+
+const char *resman_nameidx_intern(struct name_index *idx, const char *name)
+{
+	uint64_t hash;
+	struct name_entry *ent;
+	struct name_shard *shard = find_shard(idx, name, &hash);
+
+	pthread_mutex_lock(&shard->lock);
+	ent = intern(shard, name, hash);
+	pthread_mutex_unlock(&shard->lock);
+	return ent ? ent->name : 0;
+}
+
+void resman_nameidx_bind(struct name_index *idx, const char *name, int id)
+{
+	struct name_entry *ent = ENTRY(name);
+	struct name_shard *shard = idx->shard + (ent->hash >> (64 - NAMEIDX_SHARD_BITS));
+
+	pthread_mutex_lock(&shard->lock);
+	if(ent->id == -1) {
+		ent->id = id;
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+void resman_nameidx_unbind(struct name_index *idx, const char *name, int id)
+{
+	struct name_entry *ent = ENTRY(name);
+	struct name_shard *shard = idx->shard + (ent->hash >> (64 - NAMEIDX_SHARD_BITS));
+
+	pthread_mutex_lock(&shard->lock);
+	if(ent->id == id) {
+		ent->id = -1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+uint64_t resman_nameidx_hash(const char *name)
+{
+	return ENTRY(name)->hash;
+}
+
+char *resman_canon_path(const char *path, int use_realpath)
+{
+	char *res, *dst, *start, *seg;
+	const char *src;
+	int len, abs;
+	char *full = 0;
+
+	if(use_realpath) {
+#if defined(WIN32) || defined(__WIN32__)
+		/* doesn't resolve links, but at least makes the path absolute */
+		if((full = _fullpath(0, path, 0))) {
+			path = full;
+		}
+#else
+		if((res = realpath(path, 0))) {
+			return res;
+		}
+#endif
+	}
+
+	len = strlen(path);
+	if(!(res = malloc(len + 2))) {
+		free(full);
+		return 0;
+	}
+	src = path;
+	dst = res;
+	if((abs = IS_SEP(*src))) {
+		*dst++ = '/';
+	}
+	start = dst;
+
+	while(*src) {
+		while(IS_SEP(*src)) src++;
+		if(!*src) break;
+
+		for(len=0; src[len] && !IS_SEP(src[len]); len++);
+
+		if(len == 1 && src[0] == '.') {
+			src++;
+			continue;
+		}
+		if(len == 2 && src[0] == '.' && src[1] == '.') {
+			/* drop the previous segment, unless it's also a ".." */
+			seg = dst;
+			while(seg > start && seg[-1] != '/') seg--;
+			if(dst > start && !(dst - seg == 2 && seg[0] == '.' && seg[1] == '.')) {
+				dst = seg > start ? seg - 1 : start;
+				src += 2;
+				continue;
+			}
+			if(abs) {
+				src += 2;	/* "/.." is just "/" */
+				continue;
+			}
+		}
+
+		if(dst > start) {
+			*dst++ = '/';
+		}
+		memcpy(dst, src, len);
+		dst += len;
+		src += len;
+	}
+	if(dst == res) {
+		*dst++ = '.';
+	}
+	*dst = 0;
+
+	free(full);
+	return res;
+}
+
+/* the top bits of the hash pick the shard, the low bits the bucket */
+static struct name_shard *find_shard(struct name_index *idx, const char *name, uint64_t *hash)
+{
+	*hash = resman_hash(name, strlen(name), 0);
+	return idx->shard + (*hash >> (64 - NAMEIDX_SHARD_BITS));
+}
+
+static struct name_entry *lookup(struct name_shard *shard, const char *name, uint64_t hash)
+{
+	struct name_entry *ent = shard->buckets[hash & (shard->num_buckets - 1)];
+
+	while(ent) {
+		if(ent->hash == hash && strcmp(ent->name, name) == 0) {
+			return ent;
+		}
+		ent = ent->next;
+	}
+	return 0;
+}
+
+/* returns the entry for name, adding it if it's not there yet */
+static struct name_entry *intern(struct name_shard *shard, const char *name, uint64_t hash)
+{
+	struct name_entry *ent, **bucket;
+	int len;
+
+	if((ent = lookup(shard, name, hash))) {
+		return ent;
+	}
+
+	len = strlen(name);
+	if(!(ent = alloc_name(shard, offsetof(struct name_entry, name) + len + 1))) {
+		return 0;
+	}
+	ent->hash = hash;
+	ent->id = -1;
+	ent->len = len;
+	memcpy(ent->name, name, len + 1);
+
+	bucket = shard->buckets + (hash & (shard->num_buckets - 1));
+	ent->next = *bucket;
+	*bucket = ent;
+
+	if(++shard->count > shard->num_buckets) {
+		grow(shard);
+	}
+	return ent;
+}
+
+/* bump-allocate from the current block. Names too long to share a block get
+ * one of their own.
+ */
+static void *alloc_name(struct name_shard *shard, int size)
+{
+	struct name_block *blk = shard->blocks;
+	void *ptr;
+	int blksz;
+
+	size = (size + sizeof(uint64_t) - 1) & ~(int)(sizeof(uint64_t) - 1);
+
+	if(!blk || blk->size - blk->used < size) {
+		blksz = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+		if(!(blk = malloc(offsetof(struct name_block, data) + blksz))) {
+			return 0;
+		}
+		blk->size = blksz;
+		blk->used = 0;
+
+		if(size < BLOCK_SIZE || !shard->blocks) {
+			blk->next = shard->blocks;
+			shard->blocks = blk;
+		} else {
+			/* keep filling the current block */
+			blk->next = shard->blocks->next;
+			shard->blocks->next = blk;
+		}
+	}
+	ptr = (char*)blk->data + blk->used;
+	blk->used += size;
+	return ptr;
+}
+
+/* double the number of buckets. If that fails, just keep the longer chains */
+static void grow(struct name_shard *shard)
+{
+	int i, newsz = shard->num_buckets * 2;
+	struct name_entry **buckets, *ent;
+
+	if(!(buckets = calloc(newsz, sizeof *buckets))) {
+		return;
+	}
+	for(i=0; i<shard->num_buckets; i++) {
+		while((ent = shard->buckets[i])) {
+			shard->buckets[i] = ent->next;
+			ent->next = buckets[ent->hash & (newsz - 1)];
+			buckets[ent->hash & (newsz - 1)] = ent;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->num_buckets = newsz;
+}
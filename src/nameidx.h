@@ -0,0 +1,91 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_NAMEIDX_H_
+#define RESMAN_NAMEIDX_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* interned resource names, and the name to resource id mapping.
+ *
+ * Every distinct name is stored once, along with its hash, in large blocks
+ * which are only freed with the whole index. Names returned by the index stay
+ * valid until then, even after the resource using them is removed, and adding
+ * the same name again reuses the stored copy.
+ *
+ * The index is split into shards by the top bits of the name hash, each with
+ * its own lock, so that threads adding or looking up different names rarely
+ * contend.
+ */
+#define NAMEIDX_SHARD_BITS	4
+#define NAMEIDX_NUM_SHARDS	(1 << NAMEIDX_SHARD_BITS)
+
+struct name_entry;
+struct name_block;
+
+struct name_shard {
+	pthread_mutex_t lock;
+	struct name_entry **buckets;
+	int num_buckets;	/* power of two */
+	int count;
+	struct name_block *blocks;	/* name storage, most recent first */
+};
+
+struct name_index {
+	struct name_shard shard[NAMEIDX_NUM_SHARDS];
+};
+
+/* called with the shard lock held, to create the resource for a name which
+ * isn't associated with one. The name passed is the interned copy. Returns
+ * the new resource id, or -1 on failure.
+ */
+typedef int (*resman_nameidx_create_func)(const char *name, void *cls);
+
+int resman_nameidx_init(struct name_index *idx);
+void resman_nameidx_destroy(struct name_index *idx);
+
+/* returns the id associated with name, or -1 if there isn't one */
+int resman_nameidx_find(struct name_index *idx, const char *name);
+
+/* returns the id associated with name. If there isn't one, the create
+ * callback is called to make it. Lookup and creation happen under the same
+ * lock, so concurrent adds of the same name agree on the id.
+ */
+int resman_nameidx_add(struct name_index *idx, const char *name,
+		resman_nameidx_create_func create, void *cls);
+
+/* returns the interned copy of name, without associating it with anything */
+const char *resman_nameidx_intern(struct name_index *idx, const char *name);
+
+/* associates an interned name with an id, unless it already has one */
+void resman_nameidx_bind(struct name_index *idx, const char *name, int id);
+
+/* drops the association of an interned name with id. The name stays interned */
+void resman_nameidx_unbind(struct name_index *idx, const char *name, int id);
+
+/* returns the precomputed hash of an interned name */
+uint64_t resman_nameidx_hash(const char *name);
+
+/* canonical form of a path: no duplicate or trailing slashes, no "." segments,
+ * and ".." segments resolved lexically where possible. Backslashes count as
+ * slashes on windows. If use_realpath is set, paths of existing files are
+ * made absolute with symbolic links resolved. The result must be freed.
+ */
+char *resman_canon_path(const char *path, int use_realpath);
+
+#endif	/* RESMAN_NAMEIDX_H_ */
@@ -0,0 +1,149 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* read-only memory-mapped resource pack files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pack.h"
+#include "mapfile.h"
+
+struct pack {
+	char *name;
+	struct mapping map;
+
+	struct pack_header *hdr;
+	struct pack_entry *toc;
+	const char *strtab;
+};
+
+static int validate(struct pack *pack);
+
+
+struct pack *resman_pack_open(const char *fname)
+{
+	struct pack *pack;
+
+	if(!(pack = calloc(1, sizeof *pack))) {
+		return 0;
+	}
+	if(!(pack->name = strdup(fname))) {
+		free(pack);
+		return 0;
+	}
+
+	if(resman_map_file(&pack->map, fname) == -1) {
+		fprintf(stderr, "resman: failed to map pack file: %s\n", fname);
+		free(pack->name);
+		free(pack);
+		return 0;
+	}
+
+	pack->hdr = (struct pack_header*)pack->map.data;
+	if(validate(pack) == -1) {
+		fprintf(stderr, "resman: invalid or corrupted pack file: %s\n", fname);
+		resman_pack_close(pack);
+		return 0;
+	}
+	pack->toc = (struct pack_entry*)(pack->map.data + pack->hdr->toc_offs);
+	pack->strtab = (const char*)pack->map.data + pack->hdr->strtab_offs;
+	return pack;
+}
+
+void resman_pack_close(struct pack *pack)
+{
+	if(!pack) return;
+
+	resman_unmap_file(&pack->map);
+	free(pack->name);
+	free(pack);
+}
+
+const char *resman_pack_name(struct pack *pack)
+{
+	return pack->name;
+}
+
+int resman_pack_find(struct pack *pack, const char *name)
+{
+	int low = 0;
+	int high = (int)pack->hdr->num_entries - 1;
+
+	while(low <= high) {
+		int mid = low + (high - low) / 2;
+		int cmp = strcmp(name, pack->strtab + pack->toc[mid].name_offs);
+
+		if(cmp == 0) {
+			return mid;
+		}
+		if(cmp < 0) {
+			high = mid - 1;
+		} else {
+			low = mid + 1;
+		}
+	}
+	return -1;
+}
+
+const void *resman_pack_data(struct pack *pack, int idx, unsigned long *size)
+{
+	if(idx < 0 || idx >= (int)pack->hdr->num_entries) {
+		return 0;
+	}
+	if(size) {
+		*size = (unsigned long)pack->toc[idx].data_size;
+	}
+	return pack->map.data + pack->toc[idx].data_offs;
+}
+
+/* make sure nothing in the header or the entry table points outside the
+ * mapping, so that lookups don't have to check anything.
+ */
+static int validate(struct pack *pack)
+{
+	unsigned int i;
+	uint64_t toc_end;
+	struct pack_header *hdr = pack->hdr;
+	struct pack_entry *toc;
+	const char *strtab;
+
+	if(pack->map.size < sizeof *hdr || memcmp(hdr->magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0) {
+		return -1;
+	}
+
+	toc_end = (uint64_t)hdr->toc_offs + (uint64_t)hdr->num_entries * sizeof *toc;
+	if(toc_end > pack->map.size || hdr->toc_offs % sizeof(uint64_t)) {
+		return -1;
+	}
+	if(hdr->strtab_offs > pack->map.size || hdr->strtab_size > pack->map.size - hdr->strtab_offs) {
+		return -1;
+	}
+
+	toc = (struct pack_entry*)(pack->map.data + hdr->toc_offs);
+	strtab = (const char*)pack->map.data + hdr->strtab_offs;
+
+	for(i=0; i<hdr->num_entries; i++) {
+		if((uint64_t)toc[i].name_offs + toc[i].name_len >= hdr->strtab_size ||
+				strtab[toc[i].name_offs + toc[i].name_len] != 0) {
+			return -1;
+		}
+		if(toc[i].data_offs > pack->map.size || toc[i].data_size > pack->map.size - toc[i].data_offs) {
+			return -1;
+		}
+	}
+	return 0;
+}
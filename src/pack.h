@@ -0,0 +1,63 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_PACK_H_
+#define RESMAN_PACK_H_
+
+#include <stdint.h>
+
+/* pack file layout (all integers in native byte order):
+ *   header
+ *   entry table: num_entries entries, sorted by name (strcmp order)
+ *   string table: NUL-terminated entry names
+ *   file data, each entry aligned to PACK_DATA_ALIGN bytes
+ *
+ * The whole file is memory-mapped, and the sorted entry table is searched in
+ * place, so opening a pack never parses or allocates per-entry.
+ */
+#define PACK_MAGIC			"RMPACK01"
+#define PACK_MAGIC_SIZE		8
+#define PACK_DATA_ALIGN		16
+
+struct pack_header {
+	char magic[PACK_MAGIC_SIZE];
+	uint32_t num_entries;
+	uint32_t toc_offs;		/* offset of the entry table */
+	uint64_t strtab_offs;	/* offset of the string table */
+	uint64_t strtab_size;
+};
+
+struct pack_entry {
+	uint64_t data_offs;
+	uint64_t data_size;
+	uint32_t name_offs;		/* offset into the string table */
+	uint32_t name_len;
+};
+
+struct pack;
+
+struct pack *resman_pack_open(const char *fname);
+void resman_pack_close(struct pack *pack);
+
+const char *resman_pack_name(struct pack *pack);
+
+/* returns the entry index for name, or -1 if it's not in the pack */
+int resman_pack_find(struct pack *pack, const char *name);
+/* returns a pointer to the mapped data of an entry. Valid until the pack is closed */
+const void *resman_pack_data(struct pack *pack, int idx, unsigned long *size);
+
+#endif	/* RESMAN_PACK_H_ */
@@ -26,7 +26,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dynarr.h"
 #include "filewatch.h"
 #include "timer.h"
+#include "pack.h"
+#include "hash.h"
+#include "stream.h"
+#include "mempool.h"
+#include "atomic.h"
 
+#include <sys/stat.h>
 #if defined(WIN32) || defined(__WIN32__)
 #include <windows.h>
 #else
@@ -39,27 +45,82 @@ struct task {
 	struct resman *rman;
 	struct resource *res;
 
-	struct task *next;
+	/* free callback jobs, see release_resource */
+	resman_free_func free_func;
+	void *free_cls;
+	void *data;
 };
 
+/* resource creation request, for adding a name to the index */
+struct add_req {
+	struct resman *rman;
+	struct res_type *type;
+	void *data;
+	const char *file_key;	/* file identity in dedup mode, or null */
+	const char *name;		/* interned name, once the file key is looked up */
+	struct resource *res;	/* set if a new resource was created */
+};
 
-static int find_resource(struct resman *rman, const char *fname);
-static int add_resource(struct resman *rman, const char *fname, void *data);
+
+static int add_resource(struct resman *rman, const char *fname, struct res_type *type, void *data);
+static int create_resource(const char *name, void *cls);
+static int add_alias(struct resman *rman, int id, const char *name);
+static int get_file_key(const char *path, char *buf);
+static int add_child(struct resman *rman, char *name, char *sep, struct res_type *type, void *data);
+static int get_child(struct resman *rman, struct resource *parent, const char *name,
+		struct res_type *type, void *data);
+static void attach_child(struct resman *rman, struct resource *parent, struct resource *child);
+static void detach_children(struct resman *rman, struct resource *res);
+static int complete_child(struct resource *child, int run_here);
+static void finish_child(struct resman *rman, struct resource *child);
+static int call_done(struct resource *res);
+static struct resource *new_resource(struct resman *rman, const char *name, struct res_type *type, void *data);
 static void remove_resource(struct resman *rman, int idx);
+static void release_resource(struct resman *rman, struct resource *res);
+static void free_job(void *cls);
+static void process_deletions(struct resman *rman, unsigned long long start_time, long budget);
+static void done_called(struct resman *rman, struct resource *res, int result);
+static void add_to_batch(struct resman *rman, struct res_type *type, struct resource *res);
+static void flush_batch(struct resman *rman, struct res_type *type);
+static struct res_segment *alloc_segment(void);
+static void free_segment(struct res_segment *seg);
+static void resolve_pack(struct resman *rman, struct resource *res);
+static int in_pack(struct resman *rman, const char *name);
+static int any_busy(struct resman *rman);
+static int calc_file_stat(struct resource *res);
+static int calc_file_sig(struct resource *res);
+static void hash_loaded_file(struct resource *res);
+static int file_unchanged(struct resource *res);
 static void work_func(void *cls);
-/* these two functions should only be called with the resman mutex locked */
+static void init_task_pool(void);
+static void queue_load(struct resman *rman, struct resource *res);
+static void start_job(struct resman *rman, struct resource *res, struct task *work);
+static void end_load(struct resman *rman, struct resource *res);
+static void finish_load(struct resman *rman, struct resource *res, int state, int loaded);
+static void job_done(struct resman *rman, struct res_type *type);
 static struct task *alloc_task(struct resman *rman);
-static void free_task(struct resman *rman, struct task *w);
+static void free_task(struct task *w);
 
 static void wait_for_any_event(struct resman *rman);
+static struct resman_thread_pool *global_pool(void);
+static int default_num_threads(void);
 
 static struct resman_thread_pool *thread_pool;
 
+/* task allocator, shared by all managers */
+static struct mempool task_pool;
+static pthread_once_t task_pool_once = PTHREAD_ONCE_INIT;
+
 
 struct resman *resman_create(void)
+{
+	return resman_create_with_pool(0);
+}
+
+struct resman *resman_create_with_pool(struct resman_thread_pool *tpool)
 {
 	struct resman *rman = malloc(sizeof *rman);
-	if(resman_init(rman) == -1) {
+	if(resman_init_with_pool(rman, tpool) == -1) {
 		free(rman);
 		return 0;
 	}
@@ -74,30 +135,28 @@ void resman_free(struct resman *rman)
 
 int resman_init(struct resman *rman)
 {
-	const char *env;
+	return resman_init_with_pool(rman, 0);
+}
 
+int resman_init_with_pool(struct resman *rman, struct resman_thread_pool *tpool)
+{
 	/* initialize timer */
 	resman_get_time_msec();
+	resman_get_time_usec();
 
-	if(!thread_pool) {
-		/* create the thread pool if there isn't one */
-		int num_threads = 0;	/* automatically determine number of threads */
-		if((env = getenv("RESMAN_THREADS"))) {
-			num_threads = atoi(env);
-		}
-		if(num_threads < 1) {
-			if((num_threads = resman_tpool_num_processors() - 1) < 1) {
-				num_threads = 1;
-			}
-		}
-		if(!(thread_pool = resman_tpool_create(num_threads))) {
-			return -1;
-		}
+	pthread_once(&task_pool_once, init_task_pool);
+
+	if(!tpool && !(tpool = global_pool())) {
+		return -1;
 	}
-	resman_tpool_addref(thread_pool);
+	resman_tpool_addref(tpool);
 
 	memset(rman, 0, sizeof *rman);
-	rman->tpool = thread_pool;
+	rman->tpool = tpool;
+	rman->pool_weight = 1;
+	if(!(rman->tpool_client = resman_tpool_add_client(tpool, 1, 0))) {
+		return -1;
+	}
 
 #if defined(WIN32) || defined(__WIN32__)
 	if(!(rman->wait_handles = dynarr_alloc(0, sizeof *rman->wait_handles))) {
@@ -124,33 +183,100 @@ int resman_init(struct resman *rman)
 		return -1;
 	}
 
-	if(!(rman->res = dynarr_alloc(0, sizeof *rman->res))) {
+	if(!(rman->seg = calloc(RES_MAX_SEGS, sizeof *rman->seg))) {
+		return -1;
+	}
+	if(!(rman->free_ids = dynarr_alloc(0, sizeof *rman->free_ids))) {
+		return -1;
+	}
+	if(resman_nameidx_init(&rman->names) == -1) {
+		return -1;
+	}
+	if(resman_nameidx_init(&rman->inodes) == -1) {
+		return -1;
+	}
+	pthread_mutex_init(&rman->res_lock, 0);
+	pthread_mutex_init(&rman->lock, 0);
+	if(!(rman->del_queue = dynarr_alloc(0, sizeof *rman->del_queue))) {
+		return -1;
+	}
+	if(!(rman->del_list = dynarr_alloc(0, sizeof *rman->del_list))) {
+		return -1;
+	}
+	if(!(rman->groups = dynarr_alloc(0, sizeof *rman->groups))) {
+		return -1;
+	}
+	if(!(rman->packs = dynarr_alloc(0, sizeof *rman->packs))) {
+		return -1;
+	}
+	if(resman_init_types(rman) == -1) {
 		return -1;
 	}
 
 	rman->opt[RESMAN_OPT_TIMESLICE] = 16;
-
-	pthread_mutex_init(&rman->lock, 0);
+	rman->opt[RESMAN_OPT_SKIP_UNCHANGED] = 1;
+	rman->opt[RESMAN_OPT_CHUNK_SIZE] = 1048576;
+	rman->opt[RESMAN_OPT_CHUNK_BUFFERS] = 2;
 	return 0;
 }
 
 void resman_destroy(struct resman *rman)
 {
 	int i;
+	struct resource *res;
+
 	if(!rman) return;
 
-	for(i=0; i<dynarr_size(rman->res); i++) {
-		if(!rman->res[i]) continue;
+	/* streams keep running until cancelled, stop them before freeing anything */
+	for(i=0; i<rman->num_res; i++) {
+		if((res = resman_get_res(rman, i)) && res->stream) {
+			resman_cancel_stream(rman, i);
+			resman_wait_job(rman, i);
+		}
+	}
+	/* wait for any free callbacks still in flight */
+	if(rman->free_group) {
+		resman_tpool_destroy_group(rman->free_group);
+	}
+
+	for(i=0; i<rman->num_res; i++) {
+		if(!(res = resman_get_res(rman, i))) continue;
 
-		if(rman->destroy_func) {
-			rman->destroy_func(i, rman->destroy_func_cls);
+		if(res->type->destroy_func) {
+			res->type->destroy_func(i, res->type->destroy_func_cls);
 		}
-		free(rman->res[i]->name);
-		free(rman->res[i]);
+		if(res->type->free_func && res->data) {
+			res->type->free_func(res->data, res->type->free_func_cls);
+		}
+		resman_unmap_file(&res->cache_map);
+		dynarr_free(res->aliases);
+		dynarr_free(res->children);
+	}
+	for(i=0; i<RES_MAX_SEGS && rman->seg[i]; i++) {
+		free_segment(rman->seg[i]);
 	}
-	dynarr_free(rman->res);
+	free(rman->seg);
+	dynarr_free(rman->free_ids);
+	dynarr_free(rman->del_queue);
+	dynarr_free(rman->del_list);
+	resman_destroy_groups(rman);
+	resman_nameidx_destroy(&rman->names);
+	resman_nameidx_destroy(&rman->inodes);
+	pthread_mutex_destroy(&rman->res_lock);
+
+	resman_cache_close(rman->cache);
+
+	for(i=0; i<dynarr_size(rman->packs); i++) {
+		resman_pack_close(rman->packs[i]);
+	}
+	dynarr_free(rman->packs);
+
+	resman_destroy_types(rman);
 
-	resman_tpool_release(rman->tpool);
+	resman_tpool_remove_client(rman->tpool, rman->tpool_client);
+	if(resman_tpool_release(rman->tpool) == 0 && rman->tpool == thread_pool) {
+		thread_pool = 0;	/* last user of the global pool, it's gone now */
+	}
 
 #if defined(WIN32) || defined(__WIN32__)
 	dynarr_free(rman->wait_handles);
@@ -162,23 +288,136 @@ void resman_destroy(struct resman *rman)
 	pthread_mutex_destroy(&rman->lock);
 }
 
+struct resman_thread_pool *resman_create_thread_pool(const struct resman_pool_attr *attr)
+{
+	struct resman_pool_attr defattr;
+	struct resman_thread_pool *tpool;
+
+	if(attr) {
+		defattr = *attr;
+	} else {
+		resman_pool_attr_init(&defattr);
+	}
+	if(defattr.num_threads <= 0) {
+		defattr.num_threads = default_num_threads();
+	}
+
+	if(!(tpool = resman_tpool_create_attr(&defattr))) {
+		return 0;
+	}
+	resman_tpool_addref(tpool);	/* the caller's reference */
+	return tpool;
+}
+
+void resman_release_thread_pool(struct resman_thread_pool *tpool)
+{
+	if(tpool) {
+		resman_tpool_release(tpool);
+	}
+}
+
+int resman_set_thread_pool(struct resman *rman, struct resman_thread_pool *tpool)
+{
+	struct resman_thread_pool *prev = rman->tpool;
+	struct resman_tpool_client *client, *prev_client;
+
+	if(!tpool && !(tpool = global_pool())) {
+		return -1;
+	}
+	if(tpool == prev) {
+		return 0;
+	}
+	if(!(client = resman_tpool_add_client(tpool, rman->pool_weight, rman->pool_min_workers))) {
+		return -1;
+	}
+
+	/* jobs already queued on the old pool refer to it, so we can't switch
+	 * while any of our resources are being loaded. Loads are enqueued with
+	 * the lock held, so none can slip in between the check and the switch.
+	 */
+	pthread_mutex_lock(&rman->lock);
+	if(any_busy(rman)) {
+		pthread_mutex_unlock(&rman->lock);
+		resman_tpool_remove_client(tpool, client);
+		return -1;
+	}
+	prev_client = rman->tpool_client;
+	rman->tpool = tpool;
+	rman->tpool_client = client;
+	pthread_mutex_unlock(&rman->lock);
+
+	/* free callbacks are queued on the old pool too */
+	if(rman->free_group) {
+		resman_tpool_destroy_group(rman->free_group);
+		rman->free_group = 0;
+	}
+	resman_tpool_remove_client(prev, prev_client);
+	resman_tpool_addref(tpool);
+
+	/* replace the old pool's completion event in the wait list */
+#if defined(WIN32) || defined(__WIN32__)
+	rman->tpool_wait_handle = resman_tpool_get_wait_handle(tpool);
+	rman->wait_handles[0] = rman->tpool_wait_handle;
+#else
+	rman->tpool_wait_fd = resman_tpool_get_wait_fd(tpool);
+	rman->wait_fds[0] = rman->tpool_wait_fd;
+	fcntl(rman->tpool_wait_fd, F_SETFL, fcntl(rman->tpool_wait_fd, F_GETFL) | O_NONBLOCK);
+#endif
+
+	if(resman_tpool_release(prev) == 0 && prev == thread_pool) {
+		thread_pool = 0;
+	}
+	return 0;
+}
+
+struct resman_thread_pool *resman_get_thread_pool(struct resman *rman)
+{
+	return rman->tpool;
+}
+
+int resman_parallel_for(struct resman *rman, int start, int end, int grain,
+		resman_range_func func, void *cls)
+{
+	return resman_tpool_parallel_for(rman->tpool, start, end, grain, func, cls);
+}
+
+void resman_get_pool_stats(struct resman *rman, struct resman_pool_stats *stats)
+{
+	resman_tpool_get_stats(rman->tpool, stats);
+}
+
+void resman_set_pool_share(struct resman *rman, int weight, int min_workers)
+{
+	rman->pool_weight = weight > 0 ? weight : 1;
+	rman->pool_min_workers = min_workers > 0 ? min_workers : 0;
+	resman_tpool_set_client_share(rman->tpool, rman->tpool_client, rman->pool_weight,
+			rman->pool_min_workers);
+}
 
+/* the global callbacks are those of the default resource type */
 void resman_set_load_func(struct resman *rman, resman_load_func func, void *cls)
 {
-	rman->load_func = func;
-	rman->load_func_cls = cls;
+	resman_set_type_load_func(rman, 0, func, cls);
 }
 
 void resman_set_done_func(struct resman *rman, resman_done_func func, void *cls)
 {
-	rman->done_func = func;
-	rman->done_func_cls = cls;
+	resman_set_type_done_func(rman, 0, func, cls);
+}
+
+void resman_set_batch_done_func(struct resman *rman, resman_batch_done_func func, void *cls)
+{
+	resman_set_type_batch_done_func(rman, 0, func, cls);
 }
 
 void resman_set_destroy_func(struct resman *rman, resman_destroy_func func, void *cls)
 {
-	rman->destroy_func = func;
-	rman->destroy_func_cls = cls;
+	resman_set_type_destroy_func(rman, 0, func, cls);
+}
+
+void resman_set_free_func(struct resman *rman, resman_free_func func, void *cls)
+{
+	resman_set_type_free_func(rman, 0, func, cls);
 }
 
 void resman_setopt(struct resman *rman, int opt, int val)
@@ -205,24 +444,152 @@ int resman_lookup(struct resman *rman, const char *fname, void *data)
 
 int resman_add(struct resman *rman, const char *fname, void *data)
 {
-	int ridx;
+	return add_resource(rman, fname, resman_match_type(rman, fname), data);
+}
 
-	if((ridx = find_resource(rman, fname)) != -1) {
-		return ridx;
-	}
+int resman_add_typed(struct resman *rman, const char *fname, int type, void *data)
+{
+	struct res_type *rt;
 
-	/* resource not found, create a new one and start a loading job */
-	return add_resource(rman, fname, data);
+	if(!(rt = resman_get_type(rman, type))) {
+		return -1;
+	}
+	return add_resource(rman, fname, rt, data);
 }
 
 int resman_find(struct resman *rman, const char *fname)
 {
-	return find_resource(rman, fname);
+	int id;
+	char *name;
+
+	if(!(name = resman_canon_path(fname, rman->opt[RESMAN_OPT_REALPATH]))) {
+		return -1;
+	}
+	id = resman_nameidx_find(&rman->names, name);
+	free(name);
+	return id;
 }
 
 int resman_remove(struct resman *rman, int id)
 {
-	rman->res[id]->delete_pending = 1;
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, id))) {
+		return -1;
+	}
+	pthread_mutex_lock(&rman->res_lock);
+	resman_queue_delete(rman, res);
+	pthread_mutex_unlock(&rman->res_lock);
+	resman_cancel_stream(rman, id);
+	return 0;
+}
+
+int resman_add_stream(struct resman *rman, const char *fname, resman_chunk_func func,
+		void *cls, void *data)
+{
+	struct resource *res;
+	struct stream *st;
+	char *canon;
+	const char *name;
+
+	if(!(canon = resman_canon_path(fname, rman->opt[RESMAN_OPT_REALPATH]))) {
+		return -1;
+	}
+	name = resman_nameidx_intern(&rman->names, canon);
+	free(canon);
+
+	if(!name || !(res = new_resource(rman, name, resman_match_type(rman, name), data))) {
+		return -1;
+	}
+	/* a stream can share its name with another resource, but then resman_find
+	 * will keep returning the other one.
+	 */
+	resman_nameidx_bind(&rman->names, name, res->id);
+	if(!(st = resman_stream_create(rman, res, func, cls, rman->opt[RESMAN_OPT_CHUNK_SIZE],
+					rman->opt[RESMAN_OPT_CHUNK_BUFFERS]))) {
+		remove_resource(rman, res->id);
+		return -1;
+	}
+	res->stream = st;
+	res->is_stream = 1;
+	resman_update_state(res, RES_STATE_MASK, RES_LOADING);
+
+	/* on failure the stream cleans itself up, and marks the resource as done
+	 * with a failed result.
+	 */
+	resman_stream_start(st);
+	return res->id;
+}
+
+int resman_seek_stream(struct resman *rman, int res_id, long long offset)
+{
+	int ret = -1;
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, res_id))) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&rman->lock);
+	if(res->stream) {
+		ret = resman_stream_seek(res->stream, offset);
+	}
+	pthread_mutex_unlock(&rman->lock);
+	return ret;
+}
+
+void resman_cancel_stream(struct resman *rman, int res_id)
+{
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, res_id))) {
+		return;
+	}
+
+	pthread_mutex_lock(&rman->lock);
+	if(res->stream) {
+		resman_stream_cancel(res->stream);
+	}
+	pthread_mutex_unlock(&rman->lock);
+}
+
+int resman_add_pack(struct resman *rman, const char *fname)
+{
+	struct pack *pack, **tmp;
+
+	if(!(pack = resman_pack_open(fname))) {
+		return -1;
+	}
+	if(!(tmp = dynarr_push(rman->packs, &pack))) {
+		resman_pack_close(pack);
+		return -1;
+	}
+	rman->packs = tmp;
+	return 0;
+}
+
+int resman_set_cache(struct resman *rman, const char *dir, unsigned long max_size)
+{
+	struct cache *cache, *prev;
+
+	if(!(cache = resman_cache_open(dir, max_size))) {
+		return -1;
+	}
+
+	/* load functions may be using the old cache, same as with switching
+	 * thread pools, wait until nothing is being loaded.
+	 */
+	pthread_mutex_lock(&rman->lock);
+	if(any_busy(rman)) {
+		pthread_mutex_unlock(&rman->lock);
+		resman_cache_close(cache);
+		return -1;
+	}
+	prev = rman->cache;
+	rman->cache = cache;
+	pthread_mutex_unlock(&rman->lock);
+
+	resman_cache_close(prev);
 	return 0;
 }
 
@@ -234,16 +601,18 @@ int resman_pending(struct resman *rman)
 void resman_wait_job(struct resman *rman, int id)
 {
 	int cur_jobs;
-	struct resource *res = rman->res[id];
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, id))) {
+		return;
+	}
 
-	pthread_mutex_lock(&res->lock);
-	while(res->pending) {
-		pthread_mutex_unlock(&res->lock);
-		cur_jobs = resman_tpool_pending_jobs(rman->tpool);
-		resman_tpool_wait_pending(rman->tpool, cur_jobs - 1);
-		pthread_mutex_lock(&res->lock);
+	while(RES_BUSY(load_int(&RES_STATE(res)))) {
+		/* the job may complete between the two checks, don't wait forever */
+		if((cur_jobs = resman_tpool_pending_jobs(rman->tpool)) > 0) {
+			resman_tpool_wait_pending(rman->tpool, cur_jobs - 1);
+		}
 	}
-	pthread_mutex_unlock(&res->lock);
 }
 
 void resman_wait_any(struct resman *rman)
@@ -259,26 +628,25 @@ void resman_wait_all(struct resman *rman)
 
 int resman_poll(struct resman *rman)
 {
-	int i, num_res;
-	unsigned long start_time, timeslice;
+	long timeslice = rman->opt[RESMAN_OPT_TIMESLICE];
+	return resman_poll_budget(rman, timeslice > 0 ? timeslice * 1000 : -1);
+}
 
-	/* first check all the resources to see if anyone is pending deletion */
-	num_res = dynarr_size(rman->res);
-	for(i=0; i<num_res; i++) {
-		struct resource *res = rman->res[i];
-		if(!res) {
-			continue;
-		}
+int resman_poll_budget(struct resman *rman, long budget)
+{
+	int i, j, st, num_res, num_done = 0;
+	unsigned long now_msec;
+	unsigned long long start_time, cb_start, cb_time, type_budget;
+	unsigned long long pending = 0;	/* expected time of the batch callbacks not called yet */
+	struct res_segment *seg;
+	struct res_type *type;
 
-		/* also make sure we're it's off the queues/workers before deleting */
-		if(res->delete_pending && !res->pending) {
-			if(rman->destroy_func) {
-				rman->destroy_func(i, rman->destroy_func_cls);
-			}
-			remove_resource(rman, i);
-		}
-	}
+	/* destruction and done callbacks share the same budget */
+	start_time = resman_get_time_usec();
 
+	/* first remove the resources pending deletion */
+	process_deletions(rman, start_time, budget);
+	num_res = load_int(&rman->num_res);
 
 	/* then check for modified files */
 	resman_check_watch(rman);
@@ -288,59 +656,176 @@ int resman_poll(struct resman *rman)
 	while(read(rman->tpool_wait_fd, &i, sizeof i) > 0);
 #endif
 
-	if(!rman->done_func) {
-		return 0;	/* no done callback; there's no point in checking anything */
-	}
+	now_msec = resman_get_time_msec();
 
-	start_time = resman_get_time_msec();
+	for(i=0; (type = resman_get_type(rman, i)); i++) {
+		type->poll_time = 0;
+	}
 
 	for(i=0; i<num_res; i++) {
-		struct resource *res = rman->res[i];
-		if(!res) {
+		struct resource *res;
+
+		seg = rman->seg[i >> RES_SEG_SHIFT];
+		j = i & RES_SEG_MASK;
+
+		/* only touch the resource record if there's something to do. Resources
+		 * waiting for their turn to be deleted are left alone.
+		 */
+		st = load_int(seg->state + j);
+		if(st & RES_DELETE) {
 			continue;
 		}
-
-		pthread_mutex_lock(&res->lock);
-		if(!res->done_pending) {
-			int reload = res->reload_timeout && res->reload_timeout <= start_time;
-			pthread_mutex_unlock(&res->lock);
-			if(reload) {
+		if(st & RES_WATCH) {
+			/* completed by a worker, which can't touch the file monitor */
+			res = seg->res + j;
+			resman_update_state(res, RES_WATCH, 0);
+			resman_start_watch(rman, res);
+		}
+		if((st & RES_STATE_MASK) != RES_LOADED && !(st & RES_PARTIAL)) {
+			if(seg->reload_timeout[j] && seg->reload_timeout[j] <= now_msec) {
+				res = seg->res + j;
 				printf("file \"%s\" modified, delayed reload\n", res->name);
-				res->reload_timeout = 0;
+				seg->reload_timeout[j] = 0;
 				resman_reload(rman, res);
 			}
 			continue;
 		}
+		res = seg->res + j;
+		type = res->type;
+
+		/* so a done callback *is* pending, but only call it if it's expected
+		 * to fit in what's left of the budget of this poll, and of its type,
+		 * going by the previous callbacks of the same type. Otherwise leave it
+		 * for the next poll. At least one callback is called in every poll,
+		 * and one of each type, so that expensive ones don't starve.
+		 */
+		type_budget = (unsigned long long)type->opt[RESMAN_TYPE_OPT_TIMESLICE] * 1000;
+		cb_time = type->poll_time + type->batch_cost;
+		if(type_budget > 0 && cb_time > 0 && cb_time + type->done_cost > type_budget) {
+			continue;
+		}
+		cb_start = resman_get_time_usec();
+		if(budget >= 0 && num_done > 0 &&
+				cb_start - start_time + pending + type->done_cost > (unsigned long long)budget) {
+			continue;
+		}
 
-		/* so a done callback *is* pending... */
-		res->done_pending = 0;
-		if(rman->done_func(i, rman->done_func_cls) == -1) {
-			/* done-func returned -1, so let's remove the resource
-			 * but only if this was the first load. Otherwise keep it
-			 * around in case it gets valid again...
-			 */
-			if(res->num_loads == 0) {
-				pthread_mutex_unlock(&res->lock);
-				remove_resource(rman, i);
-				continue;
-			}
+		/* the worker doesn't touch the state again after setting LOADED, and
+		 * any stage it publishes after we clear the partial flag will set it
+		 * again, and get its own done callback.
+		 */
+		if((st & RES_STATE_MASK) == RES_LOADED) {
+			resman_update_state(res, RES_STATE_MASK | RES_PARTIAL, RES_DONE);
+			res->partial = 0;
+		} else {
+			resman_update_state(res, RES_PARTIAL, 0);
+			res->partial = 1;
 		}
-		res->num_loads++;
 
-		resman_start_watch(rman, res);	/* start watching the file for modifications */
-		pthread_mutex_unlock(&res->lock);
+		if(type->batch_done_func) {
+			/* collect it for the batch callback, which is called when the batch
+			 * is full, or at the end of this poll.
+			 */
+			pending -= type->batch_cost;
+			add_to_batch(rman, type, res);
+			pending += type->batch_cost;
+		} else {
+			done_called(rman, res, type->done_func(i, type->done_func_cls));
+
+			cb_time = resman_get_time_usec() - cb_start;
+			type->poll_time += cb_time;
+			type->done_cost = type->done_cost ? (type->done_cost * 7 + cb_time) / 8 : cb_time;
+		}
+		num_done++;
 
 		/* poll will be called with a high frequency anyway, so let's not spend
 		 * too much time on done callbacks each time through it
 		 */
-		timeslice = rman->opt[RESMAN_OPT_TIMESLICE];
-		if(timeslice > 0 && resman_get_time_msec() - start_time > timeslice) {
+		if(budget >= 0 && resman_get_time_usec() + pending - start_time >= (unsigned long long)budget) {
 			break;
 		}
 	}
+
+	for(i=0; (type = resman_get_type(rman, i)); i++) {
+		flush_batch(rman, type);
+	}
 	return 0;
 }
 
+/* bookkeeping after the done callback of a resource, with its return value */
+static void done_called(struct resman *rman, struct resource *res, int result)
+{
+	if(res->partial) {
+		/* intermediate result published by a loader which is still working
+		 * on this resource. Failures don't count, and the final done call
+		 * will take care of the rest.
+		 */
+		return;
+	}
+	if(result == -1 && res->num_loads == 0) {
+		/* done-func returned -1, so let's remove the resource
+		 * but only if this was the first load. Otherwise keep it
+		 * around in case it gets valid again...
+		 */
+		remove_resource(rman, res->id);
+		return;
+	}
+	res->num_loads++;
+
+	if(!res->pack && !res->is_stream && !res->parent) {
+		resman_start_watch(rman, res);	/* start watching the file for modifications */
+	}
+}
+
+static void add_to_batch(struct resman *rman, struct res_type *type, struct resource *res)
+{
+	int num = dynarr_size(type->batch);
+	int max_batch = type->opt[RESMAN_TYPE_OPT_MAX_BATCH];
+
+	type->batch = dynarr_push(type->batch, &res->id);
+	if(dynarr_size(type->batch) == num) {
+		/* out of memory, just pass this one on its own */
+		type->batch_done_func(&res->id, 1, type->batch_done_func_cls);
+		done_called(rman, res, 0);
+		return;
+	}
+	type->batch_cost += type->done_cost;
+
+	if(max_batch > 0 && num + 1 >= max_batch) {
+		flush_batch(rman, type);
+	}
+}
+
+/* call the batch done callback of a type, for the resources collected so far */
+static void flush_batch(struct resman *rman, struct res_type *type)
+{
+	int i, *tmp, num = dynarr_size(type->batch);
+	unsigned long long start, cb_time;
+	struct resource *res;
+
+	if(!num) return;
+
+	start = resman_get_time_usec();
+	type->batch_done_func(type->batch, num, type->batch_done_func_cls);
+
+	for(i=0; i<num; i++) {
+		if((res = resman_get_res(rman, type->batch[i]))) {
+			done_called(rman, res, 0);
+		}
+	}
+
+	/* the cost estimate is per resource, like for regular done callbacks */
+	cb_time = resman_get_time_usec() - start;
+	type->poll_time += cb_time;
+	cb_time /= num;
+	type->done_cost = type->done_cost ? (type->done_cost * 7 + cb_time) / 8 : cb_time;
+
+	if((tmp = dynarr_resize(type->batch, 0))) {
+		type->batch = tmp;
+	}
+	type->batch_cost = 0;
+}
+
 int resman_wait(struct resman *rman)
 {
 	wait_for_any_event(rman);
@@ -349,43 +834,197 @@ int resman_wait(struct resman *rman)
 
 const char *resman_get_res_name(struct resman *rman, int res_id)
 {
-	if(res_id >= 0 && res_id < dynarr_size(rman->res)) {
-		return rman->res[res_id]->name;
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->name;
 	}
 	return 0;
 }
 
 void resman_set_res_data(struct resman *rman, int res_id, void *data)
 {
-	if(res_id >= 0 && res_id < dynarr_size(rman->res)) {
-		rman->res[res_id]->data = data;
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		res->data = data;
 	}
 }
 
 void *resman_get_res_data(struct resman *rman, int res_id)
 {
-	if(res_id >= 0 && res_id < dynarr_size(rman->res)) {
-		return rman->res[res_id]->data;
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->data;
 	}
 	return 0;
 }
 
 int resman_get_res_result(struct resman *rman, int res_id)
 {
-	if(res_id >= 0 && res_id < dynarr_size(rman->res)) {
-		return rman->res[res_id]->result;
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->result;
 	}
 	return -1;
 }
 
-int resman_get_res_load_count(struct resman *rman, int res_id)
+int resman_get_res_type(struct resman *rman, int res_id)
 {
-	if(res_id >= 0 && res_id < dynarr_size(rman->res)) {
-		return rman->res[res_id]->num_loads;
-	}
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->type->id;
+	}
+	return -1;
+}
+
+void resman_get_stats(struct resman *rman, struct resman_stats *stats)
+{
+	pthread_mutex_lock(&rman->lock);
+	*stats = rman->stats;
+	pthread_mutex_unlock(&rman->lock);
+}
+
+int resman_publish_partial(struct resman *rman, int res_id)
+{
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, res_id)) || !RES_HAS_DONE(res->type)) {
+		return -1;
+	}
+
+	res->num_partial++;
+	if(RES_FREE_THREADED(res)) {
+		/* nobody else will call the done callback of this one */
+		res->partial = 1;
+		call_done(res);
+		res->partial = 0;
+		return 0;
+	}
+
+	/* if the previous stage hasn't been picked up yet, it's just superseded */
+	resman_update_state(res, 0, RES_PARTIAL);
+
+	/* wake up the main thread, if it's waiting for events */
+	resman_tpool_notify(rman->tpool);
+	return 0;
+}
+
+int resman_set_res_free_threaded(struct resman *rman, int res_id, int enable)
+{
+	struct resource *res;
+
+	if(!(res = resman_get_res(rman, res_id))) {
+		return -1;
+	}
+	res->free_threaded = enable;
+	return 0;
+}
+
+void resman_run_done(struct resman *rman, struct resource *res)
+{
+	res->partial = 0;
+	if(call_done(res) == -1 && res->num_loads == 0) {
+		/* same as in resman_poll, but the removal itself is left to it */
+		pthread_mutex_lock(&rman->res_lock);
+		resman_queue_delete(rman, res);
+		pthread_mutex_unlock(&rman->res_lock);
+		return;
+	}
+	res->num_loads++;
+
+	/* the file monitor belongs to the main thread, leave it to resman_poll */
+	if(!res->pack && !res->is_stream && !res->parent) {
+		resman_update_state(res, 0, RES_WATCH);
+	}
+}
+
+/* call whichever done callback the resource has, in this thread */
+static int call_done(struct resource *res)
+{
+	struct res_type *type = res->type;
+
+	if(type->done_func) {
+		return type->done_func(res->id, type->done_func_cls);
+	}
+	type->batch_done_func(&res->id, 1, type->batch_done_func_cls);
+	return 0;
+}
+
+int resman_is_partial(struct resman *rman, int res_id)
+{
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->partial;
+	}
+	return 0;
+}
+
+int resman_get_res_stage(struct resman *rman, int res_id)
+{
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->num_partial;
+	}
 	return -1;
 }
 
+int resman_get_res_load_count(struct resman *rman, int res_id)
+{
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		return res->num_loads;
+	}
+	return -1;
+}
+
+const void *resman_get_res_buffer(struct resman *rman, int res_id, unsigned long *size)
+{
+	struct resource *res;
+
+	if((res = resman_get_res(rman, res_id))) {
+		if(res->pack) {
+			return resman_pack_data(res->pack, res->pack_idx, size);
+		}
+	}
+	return 0;
+}
+
+const void *resman_cache_lookup(struct resman *rman, int res_id, unsigned long *size)
+{
+	struct resource *res;
+
+	if(!rman->cache || !(res = resman_get_res(rman, res_id))) {
+		return 0;
+	}
+
+	resman_unmap_file(&res->cache_map);
+	if(calc_file_sig(res) == -1) {
+		return 0;
+	}
+	return resman_cache_get(rman->cache, res->name, &res->sig, &res->cache_map, size);
+}
+
+int resman_cache_store(struct resman *rman, int res_id, const void *data, unsigned long size)
+{
+	struct resource *res;
+
+	if(!rman->cache || !(res = resman_get_res(rman, res_id))) {
+		return -1;
+	}
+
+	if(calc_file_sig(res) == -1) {
+		return -1;
+	}
+	return resman_cache_put(rman->cache, res->name, &res->sig, data, size);
+}
+
 #if defined(WIN32) || defined(__WIN32__)
 int *resman_get_wait_fds(struct resman *rman, int *num_fds)
 {
@@ -455,94 +1094,731 @@ static void wait_for_any_event(struct resman *rman)
 }
 #endif
 
-static int find_resource(struct resman *rman, const char *fname)
+/* the global thread pool, shared by all managers which weren't given a
+ * specific one. Created on demand, and destroyed with its last user.
+ */
+static struct resman_thread_pool *global_pool(void)
 {
-	int i, sz = dynarr_size(rman->res);
+	int num_threads = 0;	/* automatically determine number of threads */
+	const char *env;
 
-	for(i=0; i<sz; i++) {
-		if(strcmp(rman->res[i]->name, fname) == 0) {
-			return i;
+	if(!thread_pool) {
+		if((env = getenv("RESMAN_THREADS"))) {
+			num_threads = atoi(env);
 		}
+		if(num_threads < 1) {
+			num_threads = default_num_threads();
+		}
+		thread_pool = resman_tpool_create(num_threads);
 	}
-	return -1;
+	return thread_pool;
 }
 
-static int add_resource(struct resman *rman, const char *fname, void *data)
+/* leave one processor for the main thread */
+static int default_num_threads(void)
 {
-	int i, idx = -1, size = dynarr_size(rman->res);
-	struct resource *res;
-	struct resource **tmparr;
+	int num_threads;
 
-	/* allocate a new resource */
-	if(!(res = malloc(sizeof *res))) {
+	if((num_threads = resman_tpool_num_processors() - 1) < 1) {
+		num_threads = 1;
+	}
+	return num_threads;
+}
+
+/* returns the id of the resource with this name, creating it and starting a
+ * loading job if it doesn't exist yet.
+ */
+static int add_resource(struct resman *rman, const char *fname, struct res_type *type, void *data)
+{
+	int id;
+	char *name, *sep;
+	char key[64];
+	struct add_req req;
+	struct stat st;
+
+	if(!(name = resman_canon_path(fname, rman->opt[RESMAN_OPT_REALPATH]))) {
 		return -1;
 	}
-	memset(res, 0, sizeof *res);
 
-	res->name = strdup(fname);
-	assert(res->name);
-	res->data = data;
-	pthread_mutex_init(&res->lock, 0);
+	/* "file#entry" refers to an entry in a container file, unless a file or
+	 * pack entry goes by that whole name.
+	 */
+	if((sep = strrchr(name, '#')) && sep > name && sep[1] && stat(name, &st) == -1 &&
+			!in_pack(rman, name)) {
+		id = add_child(rman, name, sep, type, data);
+		free(name);
+		return id;
+	}
 
-	/* check to see if there's an empty (previously erased) slot */
-	for(i=0; i<size; i++) {
-		if(!rman->res[i]) {
-			idx = i;
-			break;
-		}
+	req.rman = rman;
+	req.type = type;
+	req.data = data;
+	req.file_key = 0;
+	req.name = 0;
+	req.res = 0;
+
+	if(rman->opt[RESMAN_OPT_DEDUP_FILES] && get_file_key(name, key) != -1) {
+		req.file_key = key;
 	}
 
-	if(idx == -1) {
-		/* free slot not found, append a new one */
-		idx = size;
+	id = resman_nameidx_add(&rman->names, name, create_resource, &req);
+	free(name);
+
+	/* start loading after the name is in the index, and the lock released */
+	if(req.res) {
+		queue_load(rman, req.res);
+	}
+	return id;
+}
+
+/* called for new names by resman_nameidx_add. In dedup mode, it's called
+ * twice: first for the name, which is then looked up by file identity, and
+ * then for the file key if the file isn't managed under any other name.
+ */
+static int create_resource(const char *name, void *cls)
+{
+	int id;
+	struct add_req *req = cls;
 
-		if(!(tmparr = dynarr_push(rman->res, &res))) {
-			free(res->name);
-			free(res);
+	if(req->file_key && !req->name) {
+		req->name = name;
+		id = resman_nameidx_add(&req->rman->inodes, req->file_key, create_resource, req);
+		if(id != -1 && !req->res && add_alias(req->rman, id, name) == -1) {
 			return -1;
 		}
-		rman->res = tmparr;
+		return id;
+	}
+
+	if(!(req->res = new_resource(req->rman, req->name ? req->name : name, req->type, req->data))) {
+		return -1;
+	}
+	if(req->file_key) {
+		req->res->file_key = name;
+	}
+	return req->res->id;
+}
+
+/* add the container file as the parent, and then the child itself */
+static int add_child(struct resman *rman, char *name, char *sep, struct res_type *type, void *data)
+{
+	int pid;
+	struct resource *parent;
+
+	*sep = 0;
+	pid = add_resource(rman, name, resman_match_type(rman, name), 0);
+	*sep = '#';
+
+	if(pid == -1 || !(parent = resman_get_res(rman, pid))) {
+		return -1;
+	}
+	return get_child(rman, parent, name, type, data);
+}
+
+/* returns the id of a child resource, creating it if it doesn't exist */
+static int get_child(struct resman *rman, struct resource *parent, const char *name,
+		struct res_type *type, void *data)
+{
+	int id;
+	struct add_req req;
+
+	req.rman = rman;
+	req.type = type;
+	req.data = data;
+	req.file_key = 0;
+	req.name = 0;
+	req.res = 0;
+
+	id = resman_nameidx_add(&rman->names, name, create_resource, &req);
+
+	if(req.res) {
+		attach_child(rman, parent, req.res);
+	}
+	return id;
+}
+
+/* a new child waits for the parent's load in progress. If the parent isn't
+ * being loaded, its last load didn't publish this entry.
+ */
+static void attach_child(struct resman *rman, struct resource *parent, struct resource *child)
+{
+	int run = 0;
+	struct resource **tmp;
+
+	pthread_mutex_lock(&rman->res_lock);
+	child->parent = parent;
+	if(!parent->children) {
+		parent->children = dynarr_alloc(0, sizeof *parent->children);
+	}
+	if(parent->children && (tmp = dynarr_push(parent->children, &child))) {
+		parent->children = tmp;
+	} else {
+		child->parent = 0;	/* out of memory, it'll just fail */
+	}
+
+	if(!child->parent || !RES_BUSY(load_int(&RES_STATE(parent)))) {
+		run = complete_child(child, 1);
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+
+	if(run) {
+		finish_child(rman, child);
+	}
+}
+
+/* unlink a resource from its parent, and mark its children for deletion.
+ * Called with the res_lock held.
+ */
+static void detach_children(struct resman *rman, struct resource *res)
+{
+	int i, num;
+	struct resource *parent, *child;
+
+	if((parent = res->parent)) {
+		num = dynarr_size(parent->children);
+		for(i=0; i<num; i++) {
+			if(parent->children[i] == res) {
+				parent->children[i] = parent->children[num - 1];
+				parent->children = dynarr_pop(parent->children);
+				break;
+			}
+		}
+		res->parent = 0;
+	}
+
+	if(res->children) {
+		for(i=0; i<dynarr_size(res->children); i++) {
+			child = res->children[i];
+			child->parent = 0;
+			/* children waiting for this load will never get it. Children being
+			 * finished by a worker (see finish_child) are left to it.
+			 */
+			if((resman_queue_delete(rman, child) & RES_STATE_MASK) == RES_QUEUED) {
+				resman_update_state(child, RES_STATE_MASK, RES_DONE);
+			}
+		}
+		dynarr_free(res->children);
+		res->children = 0;
+	}
+}
+
+/* a child is done when its parent is. Called with the res_lock held.
+ * Free-threaded children are kept busy if run_here is set, and 1 is returned,
+ * to be finished by the caller with finish_child after releasing the lock.
+ */
+static int complete_child(struct resource *child, int run_here)
+{
+	int prev, next;
+	int *stptr = &RES_STATE(child);
+	struct resource *parent = child->parent;
+
+	child->result = parent && child->published && parent->result != -1 ? 0 : -1;
+	child->published = 0;
+
+	/* failed children are kept around even on the first load, since the
+	 * entry may appear when the file is modified.
+	 */
+	if(!RES_HAS_DONE(child->type)) {
+		next = RES_DONE;
+	} else if(run_here && RES_FREE_THREADED(child)) {
+		next = RES_LOADING;
+	} else {
+		next = RES_LOADED;
+	}
+	do {
+		prev = load_int(stptr);
+		if((prev & RES_STATE_MASK) == RES_DELETING) {
+			return 0;
+		}
+	} while(!cas_int(stptr, prev, (prev & RES_DELETE) | next));
+	return next == RES_LOADING;
+}
+
+static void finish_child(struct resman *rman, struct resource *child)
+{
+	resman_run_done(rman, child);
+	resman_update_state(child, RES_STATE_MASK, RES_DONE);
+}
+
+int resman_publish_child(struct resman *rman, int parent_id, const char *entry)
+{
+	int id;
+	char *name;
+	struct resource *parent, *child;
+
+	if(!entry || !*entry || !(parent = resman_get_res(rman, parent_id))) {
+		return -1;
+	}
+	if(!(name = malloc(strlen(parent->name) + strlen(entry) + 2))) {
+		return -1;
+	}
+	sprintf(name, "%s#%s", parent->name, entry);
+
+	if((id = get_child(rman, parent, name, resman_match_type(rman, name), 0)) != -1) {
+		pthread_mutex_lock(&rman->res_lock);
+		if((child = resman_get_res(rman, id)) && child->parent == parent) {
+			child->published = 1;
+		}
+		pthread_mutex_unlock(&rman->res_lock);
+	}
+	free(name);
+	return id;
+}
+
+int resman_get_res_parent(struct resman *rman, int res_id)
+{
+	int id = -1;
+	struct resource *res;
+
+	pthread_mutex_lock(&rman->res_lock);
+	if((res = resman_get_res(rman, res_id)) && res->parent) {
+		id = res->parent->id;
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+	return id;
+}
+
+/* remember another name of a resource, to drop it when the resource is removed */
+static int add_alias(struct resman *rman, int id, const char *name)
+{
+	int ret = -1;
+	struct resource *res;
+	const char **tmp;
+
+	pthread_mutex_lock(&rman->res_lock);
+	if((res = resman_get_res(rman, id))) {
+		if(!res->aliases) {
+			res->aliases = dynarr_alloc(0, sizeof *res->aliases);
+		}
+		if(res->aliases && (tmp = dynarr_push(res->aliases, &name))) {
+			res->aliases = tmp;
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+	return ret;
+}
+
+/* file identity, which is the same for all hard and symbolic links to a file */
+#if defined(WIN32) || defined(__WIN32__)
+static int get_file_key(const char *path, char *buf)
+{
+	HANDLE fh;
+	BY_HANDLE_FILE_INFORMATION inf;
+	BOOL res;
+
+	fh = CreateFile(path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+			0, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0);
+	if(fh == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	res = GetFileInformationByHandle(fh, &inf);
+	CloseHandle(fh);
+	if(!res) {
+		return -1;
+	}
+	sprintf(buf, "%lx:%lx%08lx", (unsigned long)inf.dwVolumeSerialNumber,
+			(unsigned long)inf.nFileIndexHigh, (unsigned long)inf.nFileIndexLow);
+	return 0;
+}
+#else
+static int get_file_key(const char *path, char *buf)
+{
+	struct stat st;
+
+	if(stat(path, &st) == -1) {
+		return -1;
+	}
+	sprintf(buf, "%llx:%llx", (unsigned long long)st.st_dev, (unsigned long long)st.st_ino);
+	return 0;
+}
+#endif
+
+struct resource *resman_get_res(struct resman *rman, int id)
+{
+	struct res_segment *seg;
+
+	if(id < 0 || id >= load_int(&rman->num_res)) {
+		return 0;
+	}
+	seg = rman->seg[id >> RES_SEG_SHIFT];
+	if(load_int(seg->state + (id & RES_SEG_MASK)) == RES_FREE) {
+		return 0;
+	}
+	return seg->res + (id & RES_SEG_MASK);
+}
+
+int resman_update_state(struct resource *res, int clr, int set)
+{
+	int prev;
+	int *state = &RES_STATE(res);
+
+	do {
+		prev = load_int(state);
+	} while(!cas_int(state, prev, (prev & ~clr) | set));
+	return prev;
+}
+
+int resman_queue_delete(struct resman *rman, struct resource *res)
+{
+	int prev, num;
+
+	if((prev = resman_update_state(res, 0, RES_DELETE)) & RES_DELETE) {
+		return prev;	/* already queued */
+	}
+	/* dynarr_push leaves the array as it was if it can't grow it */
+	num = dynarr_size(rman->del_queue);
+	rman->del_queue = dynarr_push(rman->del_queue, &res->id);
+	if(dynarr_size(rman->del_queue) == num) {
+		rman->del_rescan = 1;
+	}
+	return prev;
+}
+
+/* create a new resource record, without starting to load it. The name must
+ * be interned in rman->names.
+ */
+static struct resource *new_resource(struct resman *rman, const char *name, struct res_type *type, void *data)
+{
+	int id, slot;
+	struct res_segment *seg;
+	struct resource *res;
+
+	pthread_mutex_lock(&rman->res_lock);
+	/* reuse the id of a previously erased resource if possible */
+	if(!dynarr_empty(rman->free_ids)) {
+		id = rman->free_ids[dynarr_size(rman->free_ids) - 1];
+		rman->free_ids = dynarr_pop(rman->free_ids);
+		seg = rman->seg[id >> RES_SEG_SHIFT];
 	} else {
-		/* free slot found, just use it */
-		res = rman->res[idx];
+		id = rman->num_res;
+		if(id >= RES_MAX_SEGS * RES_SEG_SIZE) {
+			pthread_mutex_unlock(&rman->res_lock);
+			return 0;
+		}
+		if(!(seg = rman->seg[id >> RES_SEG_SHIFT])) {
+			if(!(seg = alloc_segment())) {
+				pthread_mutex_unlock(&rman->res_lock);
+				return 0;
+			}
+			rman->seg[id >> RES_SEG_SHIFT] = seg;
+		}
+		/* publish the new id only after its segment is in place */
+		store_int(&rman->num_res, id + 1);
 	}
+	pthread_mutex_unlock(&rman->res_lock);
+	slot = id & RES_SEG_MASK;
 
-	res->id = idx;	/* set the resource id */
+	res = seg->res + slot;
+	memset(res, 0, sizeof *res);
+	res->id = id;
+	res->name = name;
+	res->data = data;
+	res->type = type;
+	res->seg = seg;
 
-	resman_reload(rman, rman->res[idx]);
-	return idx;
+	/* new resources are queued for loading right away by the caller */
+	cas_int(seg->state + slot, RES_FREE, RES_QUEUED);
+	return res;
 }
 
 void resman_reload(struct resman *rman, struct resource *res)
+{
+	int prev, state;
+	int *stptr = &RES_STATE(res);
+
+	do {
+		prev = load_int(stptr);
+		if((prev & RES_STATE_MASK) == RES_QUEUED || (prev & RES_DELETE)) {
+			return;	/* the queued load will pick up the changes anyway */
+		}
+		if((prev & RES_STATE_MASK) == RES_LOADING) {
+			state = prev | RES_RELOAD;	/* the worker will queue it again when done */
+		} else {
+			state = (prev & ~(RES_STATE_MASK | RES_PARTIAL)) | RES_QUEUED;
+		}
+	} while(!cas_int(stptr, prev, state));
+
+	if((prev & RES_STATE_MASK) != RES_LOADING) {
+		queue_load(rman, res);
+	}
+}
+
+/* start loading a resource in the QUEUED state, or put it in the type backlog */
+static void queue_load(struct resman *rman, struct resource *res)
 {
 	struct task *work;
+	struct res_type *type = res->type;
+	int max_jobs = type->opt[RESMAN_TYPE_OPT_MAX_JOBS];
 
-	/* start a loading job ... */
 	pthread_mutex_lock(&rman->lock);
-	work = alloc_task(rman);
+	if(max_jobs > 0 && type->active >= max_jobs) {
+		/* too many loads of this type in flight, wait for one of them to finish */
+		if(!res->in_backlog) {
+			res->in_backlog = 1;
+			res->next_backlog = 0;
+			if(type->backlog) {
+				type->backlog_tail->next_backlog = res;
+			} else {
+				type->backlog = res;
+			}
+			type->backlog_tail = res;
+		}
+		pthread_mutex_unlock(&rman->lock);
+		return;
+	}
+	type->active++;
 	pthread_mutex_unlock(&rman->lock);
+
+	work = alloc_task(rman);
+	start_job(rman, res, work);
+}
+
+/* start a loading job ... */
+static void start_job(struct resman *rman, struct resource *res, struct task *work)
+{
+	int err, prio = res->type->opt[RESMAN_TYPE_OPT_PRIORITY];
+
+	if(prio < 0) prio = 0;
+	if(prio >= RESMAN_TPOOL_NUM_PRIO) prio = RESMAN_TPOOL_NUM_PRIO - 1;
+
 	work->res = res;
 
-	res->pending = 1;
-	resman_tpool_enqueue(rman->tpool, work, work_func, 0);
+	/* the lock keeps resman_set_thread_pool from switching pools under us */
+	pthread_mutex_lock(&rman->lock);
+	err = resman_tpool_enqueue_client(rman->tpool, rman->tpool_client, prio, work, work_func, 0);
+	pthread_mutex_unlock(&rman->lock);
+
+	if(err == -1) {
+		/* no worker will ever see it, so fail the load right here. That rolls
+		 * back the active count, and lets wait/poll report the error.
+		 */
+		free_task(work);
+		resman_update_state(res, RES_STATE_MASK | RES_RELOAD, RES_LOADING);
+		res->result = -1;
+		end_load(rman, res);
+	}
+}
+
+/* a loading job of this type finished, start the next one from the backlog */
+static void job_done(struct resman *rman, struct res_type *type)
+{
+	struct resource *res = 0;
+	struct task *work;
+	int max_jobs;
+
+	pthread_mutex_lock(&rman->lock);
+	type->active--;
+
+	max_jobs = type->opt[RESMAN_TYPE_OPT_MAX_JOBS];
+	if(type->backlog && (max_jobs <= 0 || type->active < max_jobs)) {
+		res = type->backlog;
+		if(!(type->backlog = res->next_backlog)) {
+			type->backlog_tail = 0;
+		}
+		res->in_backlog = 0;
+		type->active++;
+	}
+	pthread_mutex_unlock(&rman->lock);
+
+	if(res) {
+		work = alloc_task(rman);
+		start_job(rman, res, work);
+	}
+}
+
+/* are any resources queued or being loaded */
+static int any_busy(struct resman *rman)
+{
+	int i;
+
+	for(i=0; i<load_int(&rman->num_res); i++) {
+		if(RES_BUSY(load_int(rman->seg[i >> RES_SEG_SHIFT]->state + (i & RES_SEG_MASK)))) {
+			return 1;
+		}
+	}
+	return 0;
 }
 
-/* remove a resource and leave the pointer null to reuse the slot */
+/* remove a resource and put its id on the free list for reuse */
 static void remove_resource(struct resman *rman, int idx)
 {
-	struct resource *res = rman->res[idx];
+	struct resource *res = resman_get_res(rman, idx);
+	struct res_segment *seg = res->seg;
+	int i, *tmp, slot = idx & RES_SEG_MASK;
+	const char **aliases;
+
+	resman_nameidx_unbind(&rman->names, res->name, idx);
+	if(res->file_key) {
+		resman_nameidx_unbind(&rman->inodes, res->file_key, idx);
+	}
+
+	/* no new aliases can be added after the file key is unbound */
+	pthread_mutex_lock(&rman->res_lock);
+	aliases = res->aliases;
+	res->aliases = 0;
+	detach_children(rman, res);
+	pthread_mutex_unlock(&rman->res_lock);
+
+	if(aliases) {
+		for(i=0; i<dynarr_size(aliases); i++) {
+			resman_nameidx_unbind(&rman->names, aliases[i], idx);
+		}
+		dynarr_free(aliases);
+	}
 
 	resman_stop_watch(rman, res);
 
-	if(rman->destroy_func) {
-		rman->destroy_func(idx, rman->destroy_func_cls);
+	release_resource(rman, res);
+
+	resman_unmap_file(&res->cache_map);
+
+	seg->reload_timeout[slot] = 0;
+	resman_update_state(res, ~0, RES_FREE);
+
+	/* if we can't grow the free list, this id will just never be reused */
+	pthread_mutex_lock(&rman->res_lock);
+	if((tmp = dynarr_push(rman->free_ids, &idx))) {
+		rman->free_ids = tmp;
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+}
+
+/* call the destroy callback in this thread, and pass the data on to the free
+ * callback in a worker thread, if there is one.
+ */
+static void release_resource(struct resman *rman, struct resource *res)
+{
+	struct task *work;
+	struct res_type *type = res->type;
+
+	if(type->destroy_func) {
+		type->destroy_func(res->id, type->destroy_func_cls);
 	}
+	if(!type->free_func || !res->data) {
+		return;
+	}
+
+	if(!rman->free_group) {
+		rman->free_group = resman_tpool_create_group(rman->tpool, rman->tpool_client);
+	}
+	work = alloc_task(rman);
+	work->res = 0;
+	work->free_func = type->free_func;
+	work->free_cls = type->free_func_cls;
+	work->data = res->data;
+
+	if(!rman->free_group || resman_tpool_enqueue_group(rman->free_group,
+				RESMAN_TPOOL_PRIO_LOW, work, free_job, 0) == -1) {
+		free_job(work);	/* do it ourselves then */
+	}
+}
 
-	pthread_mutex_destroy(&res->lock);
+static void free_job(void *cls)
+{
+	struct task *work = cls;
 
-	free(res->name);
-	free(res);
-	rman->res[idx] = 0;
+	work->free_func(work->data, work->free_cls);
+	free_task(work);
+}
+
+/* remove the resources queued for deletion which aren't being loaded, until
+ * the poll budget (usec, -1 for unlimited) runs out. The rest are left for the next poll.
+ */
+static void process_deletions(struct resman *rman, unsigned long long start_time, long budget)
+{
+	int i, id, st, num, num_res, kept = 0, rescan, *tmp;
+	struct res_segment *seg;
+
+	/* take over the newly queued ids, the destroy callbacks are called
+	 * without holding the lock.
+	 */
+	pthread_mutex_lock(&rman->res_lock);
+	for(i=0; i<dynarr_size(rman->del_queue); i++) {
+		num = dynarr_size(rman->del_list);
+		rman->del_list = dynarr_push(rman->del_list, rman->del_queue + i);
+		if(dynarr_size(rman->del_list) == num) {
+			rman->del_rescan = 1;
+			break;
+		}
+	}
+	if(!dynarr_empty(rman->del_queue) && (tmp = dynarr_resize(rman->del_queue, 0))) {
+		rman->del_queue = tmp;
+	}
+	rescan = rman->del_rescan;
+	rman->del_rescan = 0;
+	pthread_mutex_unlock(&rman->res_lock);
+
+	num_res = load_int(&rman->num_res);
+	if(rescan) {
+		/* ran out of memory at some point, look for them the hard way */
+		pthread_mutex_lock(&rman->res_lock);
+		for(i=0; i<num_res; i++) {
+			if(load_int(rman->seg[i >> RES_SEG_SHIFT]->state + (i & RES_SEG_MASK)) & RES_DELETE) {
+				num = dynarr_size(rman->del_list);
+				rman->del_list = dynarr_push(rman->del_list, &i);
+				if(dynarr_size(rman->del_list) == num) {
+					rman->del_rescan = 1;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&rman->res_lock);
+	}
+
+	num = dynarr_size(rman->del_list);
+	for(i=0; i<num; i++) {
+		id = rman->del_list[i];
+		seg = rman->seg[id >> RES_SEG_SHIFT];
+
+		st = load_int(seg->state + (id & RES_SEG_MASK));
+		if(!(st & RES_DELETE)) {
+			continue;	/* already removed */
+		}
+		/* also make sure it's off the queues/workers before deleting */
+		if(RES_BUSY(st) || !cas_int(seg->state + (id & RES_SEG_MASK), st, RES_DELETING)) {
+			rman->del_list[kept++] = id;
+			continue;
+		}
+		remove_resource(rman, id);	/* calls the destroy callback */
+
+		if(budget >= 0 && resman_get_time_usec() - start_time >= (unsigned long long)budget) {
+			for(i++; i<num; i++) {
+				rman->del_list[kept++] = rman->del_list[i];
+			}
+		}
+	}
+	if(kept < num && (tmp = dynarr_resize(rman->del_list, kept))) {
+		rman->del_list = tmp;
+	}
+}
+
+/* segments are cache-line aligned, and so are the worker-written fields of
+ * each resource record in them.
+ */
+static struct res_segment *alloc_segment(void)
+{
+	void *mem;
+
+#if defined(WIN32) || defined(__WIN32__)
+	if(!(mem = _aligned_malloc(sizeof(struct res_segment), CACHE_LINE_SIZE))) {
+		return 0;
+	}
+#else
+	if(posix_memalign(&mem, CACHE_LINE_SIZE, sizeof(struct res_segment)) != 0) {
+		return 0;
+	}
+#endif
+	memset(mem, 0, sizeof(struct res_segment));
+	return mem;
+}
+
+static void free_segment(struct res_segment *seg)
+{
+#if defined(WIN32) || defined(__WIN32__)
+	_aligned_free(seg);
+#else
+	free(seg);
+#endif
 }
 
 /* this is the background work function which handles all the
@@ -553,55 +1829,337 @@ static void work_func(void *cls)
 	struct task *work = cls;
 	struct resource *res = work->res;
 	struct resman *rman = work->rman;
+	struct res_type *type = res->type;
+
+	free_task(work);
+
+	/* clear the reload flag: whatever happened to the file so far, we're
+	 * about to load its current version.
+	 */
+	resman_update_state(res, RES_STATE_MASK | RES_RELOAD, RES_LOADING);
+
+	resolve_pack(rman, res);
+	res->sig_valid = res->sig_hashed = 0;
 
-	pthread_mutex_lock(&res->lock);
-	free_task(rman, work);
-	pthread_mutex_unlock(&res->lock);
+	if(rman->opt[RESMAN_OPT_SKIP_UNCHANGED] && file_unchanged(res)) {
+		/* the file was touched or rewritten with identical contents, so
+		 * there's no point in reloading it. Keep the new modification time,
+		 * so that the next touch doesn't have to hash it again.
+		 */
+		res->last_sig = res->sig;
+
+		pthread_mutex_lock(&rman->lock);
+		rman->stats.reloads_skipped++;
+		pthread_mutex_unlock(&rman->lock);
+
+		finish_load(rman, res, RES_DONE, 0);
+		return;
+	}
+	if(rman->opt[RESMAN_OPT_SKIP_UNCHANGED]) {
+		/* record the size and mtime of the version we're loading, the hash
+		 * is taken after loading it (see hash_loaded_file).
+		 */
+		calc_file_stat(res);
+	}
+
+	/* drop any cached data mapped by the previous load */
+	resman_unmap_file(&res->cache_map);
+
+	res->num_partial = 0;
+	res->result = type->load_func ? type->load_func(res->name, res->id, type->load_func_cls) : -1;
+
+	pthread_mutex_lock(&rman->lock);
+	if(res->load_calls++ > 0) {
+		rman->stats.reloads++;
+	} else {
+		rman->stats.loads++;
+	}
+	pthread_mutex_unlock(&rman->lock);
+
+	/* remember which version of the file we loaded */
+	if(rman->opt[RESMAN_OPT_SKIP_UNCHANGED] && res->result != -1) {
+		hash_loaded_file(res);
+	}
+	res->last_sig = res->sig;
+	res->last_sig_valid = res->sig_valid && res->result != -1;
+	res->last_sig_hashed = res->sig_hashed;
 
-	res->result = rman->load_func(res->name, res->id, rman->load_func_cls);
+	end_load(rman, res);
+}
 
-	pthread_mutex_lock(&res->lock);
-	res->pending = 0;	/* no longer being worked on */
+/* hand a resource over after its load function ran, or failed to run */
+static void end_load(struct resman *rman, struct resource *res)
+{
+	struct res_type *type = res->type;
 
-	if(!rman->done_func) {
+	if(!RES_HAS_DONE(type)) {
 		if(res->result == -1) {
 			/* if there's no done function and we got an error, mark this
 			 * resource for deletion in the caller context. But only if this
 			 * is the first load of this resource.
 			 */
 			if(res->num_loads == 0) {
-				res->delete_pending = 1;
+				pthread_mutex_lock(&rman->res_lock);
+				resman_queue_delete(rman, res);
+				pthread_mutex_unlock(&rman->res_lock);
 			}
+		} else if(!res->pack && !res->is_stream) {
+			/* succeded, have resman_poll start a watch */
+			resman_update_state(res, 0, RES_WATCH);
+		}
+		finish_load(rman, res, RES_DONE, 1);
+	} else if(RES_FREE_THREADED(res)) {
+		/* no need to wait for resman_poll, finish it right here */
+		resman_run_done(rman, res);
+		finish_load(rman, res, RES_DONE, 1);
+	} else {
+		/* if we have a done_func, mark this resource as loaded. This
+		 * supersedes any intermediate stage which wasn't picked up yet.
+		 */
+		finish_load(rman, res, RES_LOADED, 1);
+	}
+}
+
+/* a worker is done with this resource. If the file was modified while it was
+ * being loaded, queue it up again instead. Otherwise complete its children,
+ * or if the load function wasn't called, at least the ones waiting for it.
+ */
+static void finish_load(struct resman *rman, struct resource *res, int state, int loaded)
+{
+	int i, num, prev, next;
+	int *stptr = &RES_STATE(res);
+	struct resource *child, **run = 0;
+	/* once the state is published, resman_poll may remove the resource and
+	 * reuse its record, so grab the type before that.
+	 */
+	struct res_type *type = res->type;
+
+	/* the state changes under the lock, so that attach_child sees either the
+	 * parent busy, or its children completed.
+	 */
+	pthread_mutex_lock(&rman->res_lock);
+	do {
+		prev = load_int(stptr);
+		if((prev & RES_RELOAD) && !(prev & RES_DELETE)) {
+			next = (prev & RES_WATCH) | RES_QUEUED;
 		} else {
-			/* succeded, start a watch */
-			resman_start_watch(rman, res);
+			next = (prev & (RES_DELETE | RES_WATCH)) | state;
+		}
+	} while(!cas_int(stptr, prev, next));
+
+	if((next & RES_STATE_MASK) != RES_QUEUED && res->children) {
+		/* free-threaded children are finished right after this, without the
+		 * lock, or by resman_poll if we can't keep track of them.
+		 */
+		run = dynarr_alloc(0, sizeof *run);
+		for(i=0; i<dynarr_size(res->children); i++) {
+			child = res->children[i];
+			if(loaded || RES_BUSY(load_int(&RES_STATE(child)))) {
+				if(complete_child(child, run != 0)) {
+					num = dynarr_size(run);
+					run = dynarr_push(run, &child);
+					if(dynarr_size(run) == num) {
+						resman_update_state(child, RES_STATE_MASK, RES_LOADED);
+					}
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&rman->res_lock);
+
+	if(run) {
+		for(i=0; i<dynarr_size(run); i++) {
+			finish_child(rman, run[i]);
+		}
+		dynarr_free(run);
+	}
+
+	job_done(rman, type);
+
+	if((next & RES_STATE_MASK) == RES_QUEUED) {
+		queue_load(rman, res);
+	}
+}
+
+/* figure out if this resource should be loaded from one of the pack files.
+ * called by the workers before each (re)load. Pack entries aren't watched, so
+ * a loose file only takes over if it exists by the time the resource is loaded.
+ */
+static void resolve_pack(struct resman *rman, struct resource *res)
+{
+	int i, idx;
+	struct stat st;
+
+	res->pack = 0;
+
+	if(dynarr_empty(rman->packs)) {
+		return;
+	}
+	if(rman->opt[RESMAN_OPT_LOOSE_FILES] && stat(res->name, &st) == 0) {
+		return;
+	}
+
+	for(i=dynarr_size(rman->packs) - 1; i>=0; i--) {
+		if((idx = resman_pack_find(rman->packs[i], res->name)) != -1) {
+			res->pack = rman->packs[i];
+			res->pack_idx = idx;
+			return;
 		}
+	}
+}
+
+static int in_pack(struct resman *rman, const char *name)
+{
+	int i;
+
+	for(i=0; i<dynarr_size(rman->packs); i++) {
+		if(resman_pack_find(rman->packs[i], name) != -1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* modification time in nanoseconds, where the platform supports it */
+static int64_t file_mtime(struct stat *st)
+{
+#ifdef __linux__
+	return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+	return (int64_t)st->st_mtime * 1000000000;
+#endif
+}
+
+/* record just the size and modification time of the file backing a resource,
+ * without hashing it. Called by the workers.
+ */
+static int calc_file_stat(struct resource *res)
+{
+	struct stat st;
+	unsigned long size;
+
+	if(res->sig_valid) {
+		return 0;
+	}
+
+	if(res->pack) {
+		resman_pack_data(res->pack, res->pack_idx, &size);
+		res->sig.size = size;
+		res->sig.mtime = 0;
 	} else {
-		/* if we have a done_func, mark this resource as done */
-		res->done_pending = 1;
+		if(stat(res->name, &st) == -1) {
+			return -1;
+		}
+		res->sig.size = st.st_size;
+		res->sig.mtime = file_mtime(&st);
 	}
-	pthread_mutex_unlock(&res->lock);
+	res->sig.hash = 0;
+	res->sig_valid = 1;
+	return 0;
 }
 
-static struct task *alloc_task(struct resman *rman)
+/* calculate the signature (size, mtime, content hash) of the file backing a
+ * resource, once per load. Called by the workers.
+ */
+static int calc_file_sig(struct resource *res)
 {
-	struct task *res;
+	struct stat st;
+	const void *data;
+	unsigned long size;
+
+	if(res->sig_hashed) {
+		return 0;
+	}
 
-	if(rman->tasks) {
-		res = rman->tasks;
-		rman->tasks = res->next;
+	if(res->pack) {
+		data = resman_pack_data(res->pack, res->pack_idx, &size);
+		res->sig.size = size;
+		res->sig.mtime = 0;
+		res->sig.hash = resman_hash(data, size, 0);
 	} else {
-		if(!(res = malloc(sizeof *res))) {
-			perror("failed to allocate resman work item");
-			abort();
+		if(stat(res->name, &st) == -1 || resman_hash_file(res->name, &res->sig.hash) == -1) {
+			return -1;
 		}
-		res->rman = rman;
+		res->sig.size = st.st_size;
+		res->sig.mtime = file_mtime(&st);
+	}
+	res->sig_valid = res->sig_hashed = 1;
+	return 0;
+}
+
+/* hash the file right after the load function read it, while it's still in
+ * the page cache. If it was modified in the meantime, the hash might not be of
+ * the version we loaded, so it's left out.
+ */
+static void hash_loaded_file(struct resource *res)
+{
+	struct stat st;
+	uint64_t hash;
+
+	if(!res->sig_valid || res->sig_hashed || res->pack) {
+		return;
+	}
+	if(resman_hash_file(res->name, &hash) == -1 || stat(res->name, &st) == -1) {
+		return;
+	}
+	if(st.st_size != res->sig.size || file_mtime(&st) != res->sig.mtime) {
+		return;
+	}
+	res->sig.hash = hash;
+	res->sig_hashed = 1;
+}
+
+/* compare the file against the signature of the last successful load. The
+ * file is only hashed if the size matches, but the modification time doesn't,
+ * and the last load was hashed too. The signature is saved for this load.
+ */
+static int file_unchanged(struct resource *res)
+{
+	struct stat st;
+
+	if(!res->last_sig_valid || res->pack) {
+		return 0;
+	}
+	if(stat(res->name, &st) == -1 || st.st_size != res->last_sig.size) {
+		return 0;
+	}
+	if(file_mtime(&st) == res->last_sig.mtime) {
+		res->sig = res->last_sig;
+		res->sig_valid = 1;
+		res->sig_hashed = res->last_sig_hashed;
+		return 1;
+	}
+	if(!res->last_sig_hashed) {
+		return 0;	/* modified while being loaded, we don't know what we got */
+	}
+
+	if(calc_file_sig(res) == -1) {
+		return 0;
+	}
+	return res->sig.size == res->last_sig.size && res->sig.hash == res->last_sig.hash;
+}
+
+static void init_task_pool(void)
+{
+	if(resman_mempool_init(&task_pool, sizeof(struct task)) == -1) {
+		fprintf(stderr, "resman: failed to initialize task allocator\n");
+		abort();
+	}
+}
+
+static struct task *alloc_task(struct resman *rman)
+{
+	struct task *res;
+
+	if(!(res = resman_mempool_alloc(&task_pool))) {
+		perror("failed to allocate resman work item");
+		abort();
 	}
+	res->rman = rman;
 	return res;
 }
 
-static void free_task(struct resman *rman, struct task *w)
+static void free_task(struct task *w)
 {
-	w->next = rman->tasks;
-	rman->tasks = w;
+	resman_mempool_free(&task_pool, w);
 }
@@ -25,15 +25,116 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 typedef int (*resman_load_func)(const char *fname, int id, void *closure);
 typedef int (*resman_done_func)(int id, void *closure);
 typedef void (*resman_destroy_func)(int id, void *closure);
+/* batch done callback: alternative to the done callback, called with the ids
+ * of all the resources of a type which completed since the last poll.
+ */
+typedef void (*resman_batch_done_func)(const int *ids, int count, void *closure);
+/* free callback: second stage of destruction, called in a worker thread */
+typedef void (*resman_free_func)(void *data, void *closure);
+/* chunk callback for streaming resources: called in a worker thread for each
+ * consecutive chunk of the file. Return -1 to stop streaming.
+ */
+typedef int (*resman_chunk_func)(int id, const void *data, unsigned long size,
+		long long offset, void *closure);
+
+/* parallel_for callback: process indices [begin, end) */
+typedef void (*resman_range_func)(int begin, int end, void *closure);
+
+/* worker thread init/exit hooks, see struct resman_pool_attr */
+typedef void *(*resman_thread_init_func)(void *closure);
+typedef void (*resman_thread_exit_func)(void *data, void *closure);
 
 struct resman;
+struct resman_thread_pool;
+
+/* worker thread scheduling classes, see struct resman_pool_attr */
+enum {
+	RESMAN_SCHED_DEFAULT,
+	RESMAN_SCHED_BATCH,		/* throughput oriented, less eager to preempt others */
+	RESMAN_SCHED_IDLE		/* only run when nothing else wants the CPU */
+};
+
+/* special value for resman_pool_attr.exclude_cpu */
+#define RESMAN_CPU_CALLER	(-2)
+
+/* thread pool configuration, initialize with resman_pool_attr_init */
+struct resman_pool_attr {
+	int num_threads;			/* 0: one less than the number of processors */
+	unsigned long stack_size;	/* worker stack size in bytes (0: system default) */
+	int sched_class;			/* one of RESMAN_SCHED_* */
+	int nice;					/* nice offset of the workers, relative to the process */
+	unsigned long long affinity;	/* bitmask of CPUs workers may run on (0: any) */
+	/* keep workers off this CPU (-1: none). RESMAN_CPU_CALLER means the CPU of
+	 * the thread creating the pool; pin the main thread first for this to be
+	 * reliable.
+	 */
+	int exclude_cpu;
+
+	/* elastic pools: if max_threads is larger than min_threads, extra workers
+	 * are started when all the workers have been blocked for block_timeout msec
+	 * with jobs waiting, and surplus workers exit after idle_timeout msec of
+	 * inactivity. Both default to num_threads (fixed size pool).
+	 */
+	int min_threads, max_threads;
+	long idle_timeout;			/* default: 5000 msec */
+	long block_timeout;			/* default: 100 msec */
+
+	/* called by each worker thread when it starts and before it exits. The
+	 * value returned by thread_init is available to load callbacks running on
+	 * that thread through resman_worker_data, and is passed to thread_exit.
+	 */
+	resman_thread_init_func thread_init;
+	resman_thread_exit_func thread_exit;
+	void *thread_cls;
+
+	unsigned long scratch_size;	/* initial size of the worker scratch arenas */
+};
+
+struct resman_pool_stats {
+	int num_threads;			/* current number of worker threads */
+	int min_threads, max_threads;
+	int active;					/* workers running a job */
+	int queued;					/* jobs waiting to be picked up */
+	unsigned long spawned;		/* worker threads started since creation */
+	unsigned long retired;		/* idle worker threads which have exited */
+};
+
+struct resman_stats {
+	unsigned long loads;			/* first loads */
+	unsigned long reloads;			/* reloads due to file modification */
+	unsigned long reloads_skipped;	/* reloads skipped because the file was unchanged */
+};
 
 enum {
-	RESMAN_OPT_TIMESLICE = 0,
+	RESMAN_OPT_TIMESLICE = 0,		/* msec of callbacks per poll (default: 16, 0: unlimited) */
+	RESMAN_OPT_LOOSE_FILES,		/* loose files override pack entries (default: 0) */
+	RESMAN_OPT_SKIP_UNCHANGED,	/* don't reload files with unchanged contents (default: 1) */
+	RESMAN_OPT_CHUNK_SIZE,		/* stream chunk size in bytes (default: 1mb) */
+	RESMAN_OPT_CHUNK_BUFFERS,	/* number of chunk buffers per stream (default: 2) */
+	RESMAN_OPT_REALPATH,		/* use absolute, symlink-free names for existing files (default: 0) */
+	RESMAN_OPT_DEDUP_FILES,		/* names of the same file share one resource (default: 0) */
 
 	RESMAN_NUM_OPTIONS
 };
 
+/* per-type options, see resman_set_type_opt */
+enum {
+	RESMAN_TYPE_OPT_MAX_JOBS = 0,	/* max concurrent loads of this type (default: 0, unlimited) */
+	RESMAN_TYPE_OPT_PRIORITY,		/* queue priority, one of RESMAN_PRIO_* (default: normal) */
+	RESMAN_TYPE_OPT_TIMESLICE,		/* msec of done callbacks per poll (default: 0, unlimited) */
+	RESMAN_TYPE_OPT_MAX_BATCH,		/* max ids per batch done call (default: 0, unlimited) */
+	RESMAN_TYPE_OPT_FREE_THREADED,	/* call done callbacks in the workers (default: 0) */
+
+	RESMAN_NUM_TYPE_OPTIONS
+};
+
+enum {
+	RESMAN_PRIO_LOW,
+	RESMAN_PRIO_NORMAL,
+	RESMAN_PRIO_HIGH,
+	RESMAN_PRIO_URGENT
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,6 +145,54 @@ void resman_free(struct resman *rman);
 int resman_init(struct resman *rman);
 void resman_destroy(struct resman *rman);
 
+/* by default all resource managers share a single global thread pool. Use
+ * resman_create_thread_pool to create a separately configured pool, which can
+ * be dedicated to one manager, or explicitly shared by several. The pool is
+ * reference counted: every manager using it holds a reference, and so does
+ * the caller of resman_create_thread_pool, until resman_release_thread_pool.
+ */
+void resman_pool_attr_init(struct resman_pool_attr *attr);
+struct resman_thread_pool *resman_create_thread_pool(const struct resman_pool_attr *attr);
+void resman_release_thread_pool(struct resman_thread_pool *tpool);
+
+struct resman *resman_create_with_pool(struct resman_thread_pool *tpool);
+int resman_init_with_pool(struct resman *rman, struct resman_thread_pool *tpool);
+/* switch a manager to a different thread pool (or the global one if tpool is
+ * null). Fails if any of its resources are still being loaded. Loads started
+ * concurrently by other threads are safe, but like resman_poll, this must not
+ * race with other calls which use the pool (waits, parallel_for, etc).
+ */
+int resman_set_thread_pool(struct resman *rman, struct resman_thread_pool *tpool);
+struct resman_thread_pool *resman_get_thread_pool(struct resman *rman);
+
+/* when several managers share a thread pool, each gets a share of the workers
+ * proportional to its weight (default: 1), and jobs from one manager can't
+ * lock out the others. A manager with loads queued, and fewer than
+ * min_workers of them running, is always served first (default: 0).
+ */
+void resman_set_pool_share(struct resman *rman, int weight, int min_workers);
+
+/* for use by load callbacks: resman_worker_scratch allocates temporary memory
+ * from a per-thread arena, which is reset when the callback returns, and never
+ * needs to be freed. The arena grows as needed, to fit the largest job so far.
+ * resman_worker_data returns the value of the thread_init hook of the pool.
+ * Both return null if not called from a worker thread.
+ */
+void *resman_worker_scratch(unsigned long size);
+void *resman_worker_data(void);
+
+/* load callbacks can split up the work of decoding a single large resource,
+ * between all the workers of the thread pool. resman_parallel_for calls func
+ * for consecutive chunks of grain indices (0: automatic) covering the range
+ * [start, end), in parallel, and returns when they're all done. The calling
+ * thread processes chunks too, so nested calls can't deadlock the pool.
+ */
+int resman_parallel_for(struct resman *rman, int start, int end, int grain,
+		resman_range_func func, void *cls);
+
+/* statistics of the thread pool used by this manager */
+void resman_get_pool_stats(struct resman *rman, struct resman_pool_stats *stats);
+
 /* set the function to be called when a resource file needs to be loaded.
  * this function should perform I/O and any parts of loading which can be done
  * in a background thread.  */
@@ -53,17 +202,71 @@ void resman_set_load_func(struct resman *rman, resman_load_func func, void *cls)
  * calls resman_poll), and should be as fast as possible to avoid blocking the
  * main thread for long.  */
 void resman_set_done_func(struct resman *rman, resman_done_func func, void *cls);
+/* set a batch done callback instead, to finalize many resources at once (e.g.
+ * upload them all with a single buffer mapping). resman_poll collects the ids
+ * of the resources which would get a done callback during that poll, and
+ * passes them together, in arrays of up to RESMAN_TYPE_OPT_MAX_BATCH ids.
+ * resman_is_partial works for each of them as usual. There is no return value,
+ * call resman_remove to get rid of resources which failed. If both are set,
+ * the batch callback is used.
+ */
+void resman_set_batch_done_func(struct resman *rman, resman_batch_done_func func, void *cls);
 /* set the function to be called when a resource needs to be destroyed.
  * this function is also called in the context of the main thread. */
 void resman_set_destroy_func(struct resman *rman, resman_destroy_func func, void *cls);
+/* optionally, destruction can be split in two: the destroy callback releases
+ * anything which has to be released by the main thread (GPU objects, etc), and
+ * then the free callback is called in a worker thread, with the resource data
+ * pointer (see resman_set_res_data), to do the heavy lifting of freeing the
+ * rest. By then the resource id may already refer to another resource.
+ * The free callback is not called for resources without data.
+ * Destruction in resman_poll counts towards RESMAN_OPT_TIMESLICE, along with
+ * the done callbacks.
+ */
+void resman_set_free_func(struct resman *rman, resman_free_func func, void *cls);
 
 void resman_setopt(struct resman *rman, int opt, int val);
 int resman_getopt(struct resman *rman, int opt);
 
+/* resource types: each type has its own set of callbacks, and its own
+ * scheduling options (RESMAN_TYPE_OPT_*). resman_add picks the type of a
+ * resource by its filename extension. Files which don't match any type, belong
+ * to the default type 0, which is the one configured by resman_set_load_func,
+ * resman_set_done_func, and resman_set_destroy_func.
+ *
+ * resman_add_type registers a new type for a list of filename extensions,
+ * separated by spaces or commas (e.g. "png jpg jpeg"), or none if exts is null.
+ * Returns the type id, or -1 on failure.
+ */
+int resman_add_type(struct resman *rman, const char *exts);
+void resman_set_type_load_func(struct resman *rman, int type, resman_load_func func, void *cls);
+void resman_set_type_done_func(struct resman *rman, int type, resman_done_func func, void *cls);
+void resman_set_type_batch_done_func(struct resman *rman, int type, resman_batch_done_func func, void *cls);
+void resman_set_type_destroy_func(struct resman *rman, int type, resman_destroy_func func, void *cls);
+void resman_set_type_free_func(struct resman *rman, int type, resman_free_func func, void *cls);
+void resman_set_type_opt(struct resman *rman, int type, int opt, int val);
+int resman_get_type_opt(struct resman *rman, int type, int opt);
+
 /* call resman_add to add a new resource file and trigger the loading process.
  * If the file is already managed, this function is a no-op.
+ * Names are canonicalized first, so "./tex//a.png" and "tex/a.png" refer to the
+ * same resource, and the canonical name is what's passed to the load callback.
+ * With RESMAN_OPT_REALPATH, the names of existing files are also turned into
+ * absolute paths with symbolic links resolved. Pack entries are looked up by
+ * the canonical name, so that option bypasses packs for files which exist on
+ * disk.
+ * With RESMAN_OPT_DEDUP_FILES, a name which refers to a file that's already
+ * managed under another name (through a hard or symbolic link), becomes an
+ * alias of the existing resource, instead of loading the file again. Files are
+ * identified by device and inode (volume and file index on windows).
+ * resman_add, resman_add_typed, and resman_find can be called from any thread,
+ * including from load callbacks which discover further resources to load.
  * Returns the resource id. */
 int resman_add(struct resman *rman, const char *fname, void *data);
+/* same as resman_add, but with an explicit resource type instead of looking it
+ * up by filename extension.
+ */
+int resman_add_typed(struct resman *rman, const char *fname, int type, void *data);
 /* resman_find returns the resource id associated with a filename.
  * If no match is found, resman_find returns -1. */
 int resman_find(struct resman *rman, const char *fname);
@@ -71,14 +274,62 @@ int resman_find(struct resman *rman, const char *fname);
  * resource identifier will lead to undefined behavior. */
 int resman_remove(struct resman *rman, int id);
 
+/* add a pack file to search for resources. Pack files added later take
+ * precedence over earlier ones. When RESMAN_OPT_LOOSE_FILES is enabled, a
+ * loose file with the same name overrides any pack entry, which allows
+ * hot-reloading individual files during development. Only files which exist
+ * when the resource is loaded are picked up; resources loaded from a pack
+ * aren't watched, so a loose file created afterwards is ignored.
+ * Packs should be added before any resources which might be found in them.
+ * Returns 0 on success, -1 on failure.
+ */
+int resman_add_pack(struct resman *rman, const char *fname);
+
+/* add a streaming resource. Instead of calling the load callback, resman reads
+ * the file in chunks of RESMAN_OPT_CHUNK_SIZE bytes, reading ahead while the
+ * chunk callback processes the previous chunk. Memory use is bounded by
+ * RESMAN_OPT_CHUNK_SIZE * RESMAN_OPT_CHUNK_BUFFERS regardless of file size.
+ * The done callback is called after the end of the stream is reached, or the
+ * stream is cancelled. Streaming resources are not watched for modification.
+ * Returns the resource id, or -1 on failure.
+ */
+int resman_add_stream(struct resman *rman, const char *fname, resman_chunk_func func,
+		void *cls, void *data);
+/* seek to a byte offset. The next chunk passed to the chunk callback will start
+ * from there. Can also be called from the chunk callback, to loop a stream.
+ * Returns -1 if the stream is already over.
+ */
+int resman_seek_stream(struct resman *rman, int res_id, long long offset);
+/* stop streaming. The done callback will still be called */
+void resman_cancel_stream(struct resman *rman, int res_id);
+
+/* enable the persistent cache of processed resource data, in directory dir.
+ * max_size is the cache size limit in bytes (0 for unlimited). When the limit
+ * is exceeded, the least recently used entries are deleted. Replacing the
+ * cache fails if any resources are still being loaded.
+ * Returns 0 on success, -1 on failure.
+ */
+int resman_set_cache(struct resman *rman, const char *dir, unsigned long max_size);
+
 /* returns number of pending jobs */
 int resman_pending(struct resman *rman);
 void resman_wait_job(struct resman *rman, int id);
 void resman_wait_any(struct resman *rman);
 void resman_wait_all(struct resman *rman);
 
-/* call resman_poll in your main thread to schedule done/destroy callbacks */
+/* call resman_poll in your main thread to schedule done/destroy callbacks.
+ * If RESMAN_OPT_TIMESLICE is set (msec, default: 16), poll returns when it
+ * runs out of time, and leaves the rest for the next call. Done callbacks are
+ * only started if they're expected to fit in the remaining time, based on a
+ * moving average of the previous callbacks of the same type.
+ */
 int resman_poll(struct resman *rman);
+/* same as resman_poll, but with a time budget in microseconds for this call
+ * only, instead of RESMAN_OPT_TIMESLICE. Pass whatever is left of the frame
+ * time, or -1 for no limit. At least one callback is called on each poll
+ * regardless, so that loading always makes progress.
+ */
+int resman_poll_budget(struct resman *rman, long budget);
 
 /* wait for any event (job completion, or file modification)
  * you must schedule a call to resman_poll after resman_wait returns.
@@ -94,6 +345,104 @@ int resman_get_res_result(struct resman *rman, int res_id);
 
 int resman_get_res_load_count(struct resman *rman, int res_id);
 
+int resman_get_res_type(struct resman *rman, int res_id);
+
+/* progressive loading: called by the load callback to publish an intermediate
+ * result (a low resolution mip level, a coarse LOD, etc), while it carries on
+ * refining the resource. This schedules an early call to the done callback
+ * during the next resman_poll. If a previous stage is still waiting for its
+ * done call, the two are merged into one.
+ * Returns 0 on success, -1 if there's no done callback.
+ */
+int resman_publish_partial(struct resman *rman, int res_id);
+/* returns non-zero if the done callback currently running is for an
+ * intermediate stage published with resman_publish_partial. The done callback
+ * will be called again once loading is complete.
+ */
+int resman_is_partial(struct resman *rman, int res_id);
+/* returns the number of intermediate stages published during the current load */
+int resman_get_res_stage(struct resman *rman, int res_id);
+
+/* free-threaded completion, for resources which don't need the main thread to
+ * be finalized (CPU-only data, like navigation meshes or configuration). Their
+ * done callback is called by the worker right after the load callback, instead
+ * of waiting for the next resman_poll, and so are the done callbacks of any
+ * free-threaded sub-resources waiting for them. Intermediate stages get their
+ * done callback immediately, in the thread publishing them. A failure on the
+ * first load still removes the resource during the next poll.
+ * Enable it for a whole type with RESMAN_TYPE_OPT_FREE_THREADED, or for single
+ * resources with resman_set_res_free_threaded, which can be called from the
+ * load callback. Returns -1 if the resource doesn't exist.
+ */
+int resman_set_res_free_threaded(struct resman *rman, int res_id, int enable);
+
+/* sub-resources: a name of the form "file#entry" refers to an entry in a
+ * container file, like a texture atlas, font sheet, or model bundle. Adding
+ * it also adds the file itself as the parent resource, and the file is loaded
+ * once, by the load callback of the parent, for all its entries. The parent's
+ * load callback calls resman_publish_child for each entry it finds, and can
+ * pass the parsed data with resman_set_res_data. When the parent finishes
+ * loading, each of its children is completed, and gets its own done callback,
+ * with a failed result if the parent didn't publish it. Children are reloaded
+ * along with the parent when the file changes, and aren't watched separately.
+ * The type of a child is picked by the extension of the entry, if any.
+ * Names of existing files containing '#' are not treated as sub-resources.
+ *
+ * resman_publish_child returns the id of the child, adding it if necessary.
+ */
+int resman_publish_child(struct resman *rman, int parent_id, const char *entry);
+/* returns the parent of a sub-resource, or -1 */
+int resman_get_res_parent(struct resman *rman, int res_id);
+
+/* resource groups: load, wait for, and unload sets of resources together, such
+ * as all the assets of a level. A resource can belong to several groups, and
+ * is only unloaded with the last of them. Groups should only be used from the
+ * thread calling resman_poll.
+ *
+ * resman_create_group returns a new empty group, or -1 on failure.
+ * resman_group_add adds a resource like resman_add, and makes it a member of
+ * the group. Returns the resource id, or -1 on failure.
+ */
+int resman_create_group(struct resman *rman);
+int resman_group_add(struct resman *rman, int group, const char *fname, void *data);
+/* wait until none of the members are being loaded. Their done callbacks are
+ * still called by resman_poll as usual.
+ */
+void resman_group_wait(struct resman *rman, int group);
+/* returns the number of members which are done, including their done
+ * callbacks, and the total number of members through total. Members removed
+ * because they failed to load count as done. Returns -1 for invalid groups.
+ */
+int resman_group_progress(struct resman *rman, int group, int *total);
+/* remove all the members which don't belong to any other group, and free the
+ * group. Removal is deferred to resman_poll, which destroys a few of them at
+ * a time within RESMAN_OPT_TIMESLICE, instead of stalling a single frame.
+ */
+void resman_group_unload(struct resman *rman, int group);
+
+void resman_get_stats(struct resman *rman, struct resman_stats *stats);
+
+/* if the resource was found in a pack file, returns a pointer to its data in
+ * the memory-mapped pack, and its size through the size argument. The data are
+ * read-only, and remain valid until the resource manager is destroyed.
+ * Returns null if the resource should be loaded from a regular file instead.
+ * Intended to be called from the load callback.
+ */
+const void *resman_get_res_buffer(struct resman *rman, int res_id, unsigned long *size);
+
+/* look up processed data previously stored in the cache for this resource.
+ * The cache is keyed by the resource name, and the size, modification time and
+ * content hash of its file, so any change to the file invalidates the entry.
+ * Returns a pointer to the memory-mapped data, or null on cache miss. The data
+ * are read-only and remain valid until the next reload of the resource starts.
+ * Intended to be called from the load callback.
+ */
+const void *resman_cache_lookup(struct resman *rman, int res_id, unsigned long *size);
+/* store processed data for this resource in the cache, for use by
+ * resman_cache_lookup in subsequent runs. Returns 0 on success, -1 on failure.
+ */
+int resman_cache_store(struct resman *rman, int res_id, const void *data, unsigned long size);
+
 /* return pointer to an internal array of file descriptors which can be used to
  * wait for pending jobs or file modification events. The appropriate action
  * when any of these file descriptors are readable, is to simply call
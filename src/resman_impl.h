@@ -21,6 +21,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include "rbtree.h"
 #include "tpool.h"
+#include "cache.h"
+#include "nameidx.h"
 
 #ifdef __linux__
 #include <unistd.h>
@@ -33,21 +35,77 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "resman.h"
 
 struct task;
+struct pack;
+struct stream;
+struct res_group;
+
+struct res_type {
+	int id;
+	char *exts;		/* list of filename extensions, or null */
+
+	resman_load_func load_func;
+	resman_done_func done_func;
+	resman_batch_done_func batch_done_func;
+	resman_destroy_func destroy_func;
+	resman_free_func free_func;
+
+	void *load_func_cls;
+	void *done_func_cls;
+	void *batch_done_func_cls;
+	void *destroy_func_cls;
+	void *free_func_cls;
+
+	int opt[RESMAN_NUM_TYPE_OPTIONS];
+
+	/* protected by the resman lock */
+	int active;		/* number of jobs of this type in the thread pool */
+	struct resource *backlog, *backlog_tail;	/* waiting for a free job slot */
+
+	/* used by resman_poll */
+	unsigned long long poll_time;	/* usec spent in done callbacks during this poll */
+	unsigned long done_cost;	/* moving average of the done callback time in usec */
+	int *batch;		/* dynamic array of ids waiting for the batch done callback */
+	unsigned long long batch_cost;	/* expected time of the batch done callback */
+};
+
+/* resources of this type get a done callback from resman_poll */
+#define RES_HAS_DONE(type)	((type)->done_func || (type)->batch_done_func)
+
+/* keep data written by different threads on separate cache lines */
+#define CACHE_LINE_SIZE		64
+#ifdef _MSC_VER
+#define CACHE_ALIGNED	__declspec(align(CACHE_LINE_SIZE))
+#else
+#define CACHE_ALIGNED	__attribute__((aligned(CACHE_LINE_SIZE)))
+#endif
+
+struct res_segment;
 
 struct resource {
+	/* set up by the main thread, mostly read-only afterwards */
 	int id;
-	char *name;
+	const char *name;	/* interned in rman->names */
+	struct res_type *type;
+	struct res_segment *seg;	/* segment holding this record and its flags */
 	void *data;
-	int result;	/* last callback-reported success/fail code */
 
-	int pending;		/* is being enqueued or actively worked on */
-	int done_pending;	/* loading completed but done callback not called yet */
-	int delete_pending;	/* marked for deletion during the next poll */
-	pthread_mutex_t lock;
+	const char *file_key;	/* interned in rman->inodes, in dedup mode */
+	const char **aliases;	/* dynamic array of other names of this file, or null */
+
+	/* sub-resources, see resman_publish_child. Protected by rman->res_lock */
+	struct resource *parent;
+	struct resource **children;	/* dynamic array, or null */
+	int published;		/* published by the parent during its current load */
+	int num_groups;		/* number of groups this resource belongs to, also res_lock */
 
 	int num_loads;		/* number of loads up to now */
+	int load_calls;		/* times the load function was called, by the workers */
+	int is_stream;
+	int partial;		/* the current done callback is for an intermediate stage */
 
-	unsigned long reload_timeout;	/* absolute msec of next reload (usually 0) */
+	/* waiting in the type backlog for a free job slot (see RESMAN_TYPE_OPT_MAX_JOBS) */
+	int in_backlog;
+	struct resource *next_backlog;
 
 	/* file change monitoring */
 #ifdef WIN32
@@ -56,22 +114,98 @@ struct resource {
 #ifdef __linux__
 	int nfd;	/* notify file descriptor */
 #endif
+
+	/* written by the workers while loading */
+	CACHE_ALIGNED int result;	/* last callback-reported success/fail code */
+	int free_threaded;	/* see resman_set_res_free_threaded */
+	int num_partial;	/* intermediate stages published during the current load */
+
+	/* pack entry backing this resource (null for loose files) */
+	struct pack *pack;
+	int pack_idx;
+
+	/* file signature for the current load, calculated on demand */
+	struct file_sig sig;
+	int sig_valid, sig_hashed;
+	/* file signature at the last successful load, to detect spurious reloads */
+	struct file_sig last_sig;
+	int last_sig_valid, last_sig_hashed;
+
+	struct mapping cache_map;	/* mapped cache entry returned by resman_cache_lookup */
+
+	struct stream *stream;	/* non-null while a streaming resource is being read */
+};
+
+/* resource lifecycle. The state of each resource is a single word, which is
+ * only ever changed by compare and swap, and holds one of these states in the
+ * low bits, along with the RES_* flags below.
+ */
+enum {
+	RES_FREE,		/* unused slot */
+	RES_QUEUED,		/* waiting for a worker, or for a job slot in the type backlog */
+	RES_LOADING,	/* being loaded by a worker, or streamed */
+	RES_LOADED,		/* loading completed but done callback not called yet */
+	RES_DONE,		/* done callback called, or not needed */
+	RES_DELETING	/* being removed by resman_poll */
+};
+#define RES_STATE_MASK	0x0f
+#define RES_PARTIAL		0x10	/* intermediate stage published, done callback pending */
+#define RES_RELOAD		0x20	/* file modified while loading, load it again afterwards */
+#define RES_DELETE		0x40	/* queued for deletion by resman_poll */
+#define RES_WATCH		0x80	/* loaded by a worker, resman_poll should start watching it */
+
+#define RES_BUSY(st)	\
+	(((st) & RES_STATE_MASK) == RES_QUEUED || ((st) & RES_STATE_MASK) == RES_LOADING)
+
+/* resource records are stored in fixed-size segments, which are never moved
+ * or freed until the manager is destroyed. The state words checked by
+ * resman_poll for every resource are kept in dense arrays at the start of the
+ * segment, so that scanning them doesn't touch the records themselves.
+ */
+#define RES_SEG_SHIFT	8
+#define RES_SEG_SIZE	(1 << RES_SEG_SHIFT)
+#define RES_SEG_MASK	(RES_SEG_SIZE - 1)
+#define RES_MAX_SEGS	4096
+
+struct res_segment {
+	int state[RES_SEG_SIZE];					/* lifecycle state and flags */
+	unsigned long reload_timeout[RES_SEG_SIZE];	/* absolute msec of next reload (usually 0) */
+
+	struct resource res[RES_SEG_SIZE];
 };
 
+#define RES_STATE(res)			((res)->seg->state[(res)->id & RES_SEG_MASK])
+/* the done callback is called by the workers instead of resman_poll */
+#define RES_FREE_THREADED(res)	\
+	((res)->free_threaded || (res)->type->opt[RESMAN_TYPE_OPT_FREE_THREADED])
+#define RES_RELOAD_TIMEOUT(res)	((res)->seg->reload_timeout[(res)->id & RES_SEG_MASK])
+
 
 struct resman {
-	struct resource **res;
+	/* resources can be added from any thread. Segments are never moved, and
+	 * num_res is only increased after the segment it reaches into is in the
+	 * directory, so readers don't need any locking.
+	 */
+	struct res_segment **seg;	/* segment directory, RES_MAX_SEGS entries */
+	int num_res;	/* one past the highest resource id ever used */
+	int *free_ids;	/* dynamic array of ids available for reuse */
+	pthread_mutex_t res_lock;	/* serializes id allocation and parent/child links */
+	int *del_queue;		/* ids marked for deletion, protected by res_lock */
+	int del_rescan;		/* del_queue overflowed, poll has to look for them */
+	int *del_list;		/* ids being deleted by resman_poll, a few at a time */
+	struct res_group **groups;	/* dynamic array of resource groups, null if unused */
+	struct name_index names;	/* resource name -> id */
+	struct name_index inodes;	/* file identity -> id, see RESMAN_OPT_DEDUP_FILES */
 	struct resman_thread_pool *tpool;
+	struct resman_tpool_client *tpool_client;	/* our share of the thread pool */
+	struct resman_tpool_group *free_group;	/* free callback jobs, created on demand */
+	int pool_weight, pool_min_workers;
+	struct pack **packs;	/* dynamic array of open pack files */
+	struct cache *cache;	/* persistent processed data cache (optional) */
 
-	pthread_mutex_t lock;	/* global resman lock (for res array changes) */
+	pthread_mutex_t lock;	/* global resman lock (backlogs, stats, stream pointers) */
 
-	resman_load_func load_func;
-	resman_done_func done_func;
-	resman_destroy_func destroy_func;
-
-	void *load_func_cls;
-	void *done_func_cls;
-	void *destroy_func_cls;
+	struct res_type **types;	/* dynamic array of resource types. 0 is the default */
 
 	/* file change monitoring */
 	struct rbtree *nresmap;
@@ -89,13 +223,38 @@ struct resman {
 	int *wait_fds;	/* dynamic array of all the waitable fds (inotify + tpool) */
 #endif
 
-	/* list of free work item structures for the work item allocator */
-	struct task *tasks;
-
 	int opt[RESMAN_NUM_OPTIONS];
+	struct resman_stats stats;
 };
 
 void resman_reload(struct resman *rman, struct resource *res);
 
+/* returns the resource with this id, or null if it doesn't exist */
+struct resource *resman_get_res(struct resman *rman, int id);
+
+/* atomically clear the bits in clr and set the bits in set, in the state word
+ * of a resource. Returns the previous state word.
+ */
+int resman_update_state(struct resource *res, int clr, int set);
+
+/* mark a resource for deletion, and add it to the deletion queue processed by
+ * resman_poll. Called with the res_lock held. Returns the previous state word.
+ */
+int resman_queue_delete(struct resman *rman, struct resource *res);
+
+/* call the done callback of a free-threaded resource in this thread. The
+ * resource must be in a busy state, so that resman_poll leaves it alone.
+ */
+void resman_run_done(struct resman *rman, struct resource *res);
+
+/* resource type registry (restype.c) */
+int resman_init_types(struct resman *rman);
+void resman_destroy_types(struct resman *rman);
+struct res_type *resman_match_type(struct resman *rman, const char *fname);
+struct res_type *resman_get_type(struct resman *rman, int type);
+
+/* resource groups (group.c) */
+void resman_destroy_groups(struct resman *rman);
+
 
 #endif	/* RESMAN_IMPL_H_ */
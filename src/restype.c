@@ -0,0 +1,229 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* resource type registry: per-type callbacks and scheduling options */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "resman.h"
+#include "resman_impl.h"
+#include "dynarr.h"
+
+static int match_ext(const char *exts, const char *ext);
+
+
+int resman_init_types(struct resman *rman)
+{
+	if(!(rman->types = dynarr_alloc(0, sizeof *rman->types))) {
+		return -1;
+	}
+	/* type 0 is the default type, used for files which don't match any
+	 * registered extension, and configured by resman_set_*_func.
+	 */
+	if(resman_add_type(rman, 0) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+void resman_destroy_types(struct resman *rman)
+{
+	int i;
+
+	if(!rman->types) return;
+
+	for(i=0; i<dynarr_size(rman->types); i++) {
+		free(rman->types[i]->exts);
+		dynarr_free(rman->types[i]->batch);
+		free(rman->types[i]);
+	}
+	dynarr_free(rman->types);
+	rman->types = 0;
+}
+
+/* the types array is protected by rman->lock, since resman_add can be called
+ * from any thread while new types are registered. The types themselves never
+ * move or go away until the manager is destroyed.
+ */
+struct res_type *resman_match_type(struct resman *rman, const char *fname)
+{
+	int i;
+	const char *ext, *slash;
+	struct res_type *type;
+
+	if(!(ext = strrchr(fname, '.'))) {
+		return resman_get_type(rman, 0);
+	}
+	if((slash = strrchr(fname, '/')) && slash > ext) {
+		return resman_get_type(rman, 0);
+	}
+	ext++;
+
+	pthread_mutex_lock(&rman->lock);
+	type = rman->types[0];
+	for(i=1; i<dynarr_size(rman->types); i++) {
+		if(match_ext(rman->types[i]->exts, ext)) {
+			type = rman->types[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rman->lock);
+	return type;
+}
+
+struct res_type *resman_get_type(struct resman *rman, int type)
+{
+	struct res_type *rt = 0;
+
+	pthread_mutex_lock(&rman->lock);
+	if(type >= 0 && type < dynarr_size(rman->types)) {
+		rt = rman->types[type];
+	}
+	pthread_mutex_unlock(&rman->lock);
+	return rt;
+}
+
+int resman_add_type(struct resman *rman, const char *exts)
+{
+	struct res_type *type, **tmp;
+	char *ptr;
+
+	if(!(type = calloc(1, sizeof *type))) {
+		return -1;
+	}
+	if(!(type->batch = dynarr_alloc(0, sizeof *type->batch))) {
+		free(type);
+		return -1;
+	}
+	if(exts) {
+		if(!(type->exts = strdup(exts))) {
+			dynarr_free(type->batch);
+			free(type);
+			return -1;
+		}
+		for(ptr=type->exts; *ptr; ptr++) {
+			*ptr = tolower((unsigned char)*ptr);
+		}
+	}
+	type->opt[RESMAN_TYPE_OPT_PRIORITY] = RESMAN_PRIO_NORMAL;
+
+	pthread_mutex_lock(&rman->lock);
+	if(!(tmp = dynarr_push(rman->types, &type))) {
+		pthread_mutex_unlock(&rman->lock);
+		dynarr_free(type->batch);
+		free(type->exts);
+		free(type);
+		return -1;
+	}
+	rman->types = tmp;
+	type->id = dynarr_size(rman->types) - 1;
+	pthread_mutex_unlock(&rman->lock);
+
+	return type->id;
+}
+
+void resman_set_type_load_func(struct resman *rman, int type, resman_load_func func, void *cls)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt) {
+		rt->load_func = func;
+		rt->load_func_cls = cls;
+	}
+}
+
+void resman_set_type_done_func(struct resman *rman, int type, resman_done_func func, void *cls)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt) {
+		rt->done_func = func;
+		rt->done_func_cls = cls;
+	}
+}
+
+void resman_set_type_batch_done_func(struct resman *rman, int type, resman_batch_done_func func, void *cls)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt) {
+		rt->batch_done_func = func;
+		rt->batch_done_func_cls = cls;
+	}
+}
+
+void resman_set_type_destroy_func(struct resman *rman, int type, resman_destroy_func func, void *cls)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt) {
+		rt->destroy_func = func;
+		rt->destroy_func_cls = cls;
+	}
+}
+
+void resman_set_type_free_func(struct resman *rman, int type, resman_free_func func, void *cls)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt) {
+		rt->free_func = func;
+		rt->free_func_cls = cls;
+	}
+}
+
+void resman_set_type_opt(struct resman *rman, int type, int opt, int val)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt && opt >= 0 && opt < RESMAN_NUM_TYPE_OPTIONS) {
+		rt->opt[opt] = val;
+	}
+}
+
+int resman_get_type_opt(struct resman *rman, int type, int opt)
+{
+	struct res_type *rt = resman_get_type(rman, type);
+	if(rt && opt >= 0 && opt < RESMAN_NUM_TYPE_OPTIONS) {
+		return rt->opt[opt];
+	}
+	return 0;
+}
+
+/* case-insensitive match of ext against a whitespace or comma separated list */
+static int match_ext(const char *exts, const char *ext)
+{
+	const char *ptr, *end;
+	int len;
+
+	if(!exts) return 0;
+
+	ptr = exts;
+	while(*ptr) {
+		while(*ptr && (isspace((unsigned char)*ptr) || *ptr == ',' || *ptr == '.')) ptr++;
+		end = ptr;
+		while(*end && !isspace((unsigned char)*end) && *end != ',') end++;
+
+		len = end - ptr;
+		if(len > 0 && (int)strlen(ext) == len) {
+			int i;
+			for(i=0; i<len; i++) {
+				if(tolower((unsigned char)ext[i]) != ptr[i]) break;
+			}
+			if(i == len) {
+				return 1;
+			}
+		}
+		ptr = end;
+	}
+	return 0;
+}
@@ -0,0 +1,410 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* chunked streaming of large files.
+ *
+ * A stream cycles a fixed set of buffers between a reader job, which fills
+ * free buffers with consecutive chunks of the file, and a consumer job which
+ * passes full buffers to the chunk callback in order. Each job runs on the
+ * thread pool only while it has something to do, and never blocks waiting for
+ * the other, so streams work even with a single worker thread. While the
+ * consumer is processing one chunk, the reader is already filling the next.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stream.h"
+#include "resman_impl.h"
+
+#if defined(WIN32) || defined(__WIN32__)
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+enum { BUF_FREE, BUF_READING, BUF_FULL, BUF_CONSUMING };
+
+struct stream_buf {
+	char *data;
+	long size;
+	long long offs;		/* file offset of this chunk */
+	unsigned int seq;	/* chunk sequence number since the last seek */
+	unsigned int gen;	/* seek generation this chunk was read in */
+	int state;
+};
+
+struct stream {
+	struct resman *rman;
+	struct resource *res;
+
+	resman_chunk_func func;
+	void *cls;
+
+	int fd;
+	int chunk_size;
+	struct stream_buf *bufs;
+	int num_bufs;
+
+	long long read_offs;		/* file offset of the next read */
+	unsigned int read_seq;		/* sequence number of the next chunk to read */
+	unsigned int cons_seq;		/* sequence number of the next chunk to consume */
+	unsigned int gen;			/* incremented on every seek */
+
+	int reading, consuming;		/* reader/consumer jobs in flight */
+	int eof, cancel, error, finished;
+
+	pthread_mutex_t lock;
+};
+
+static void read_job(void *cls);
+static void consume_job(void *cls);
+static int start_reader(struct stream *st);
+static int start_consumer(struct stream *st);
+static int check_finished(struct stream *st);
+static void finish(struct stream *st);
+static void free_stream(struct stream *st);
+static struct stream_buf *find_buf(struct stream *st, int state, unsigned int seq);
+static long read_at(int fd, void *buf, long size, long long offs);
+
+
+struct stream *resman_stream_create(struct resman *rman, struct resource *res,
+		resman_chunk_func func, void *cls, int chunk_size, int num_bufs)
+{
+	int i;
+	struct stream *st;
+
+	if(!(st = calloc(1, sizeof *st))) {
+		return 0;
+	}
+	st->rman = rman;
+	st->res = res;
+	st->func = func;
+	st->cls = cls;
+	st->chunk_size = chunk_size > 0 ? chunk_size : 1048576;
+	st->num_bufs = num_bufs > 1 ? num_bufs : 2;
+	st->fd = -1;
+	pthread_mutex_init(&st->lock, 0);
+
+	if(!(st->bufs = calloc(st->num_bufs, sizeof *st->bufs))) {
+		goto err;
+	}
+	for(i=0; i<st->num_bufs; i++) {
+		if(!(st->bufs[i].data = malloc(st->chunk_size))) {
+			goto err;
+		}
+	}
+
+#if defined(WIN32) || defined(__WIN32__)
+	st->fd = open(res->name, O_RDONLY | O_BINARY);
+#else
+	st->fd = open(res->name, O_RDONLY);
+#endif
+	if(st->fd == -1) {
+		fprintf(stderr, "resman: failed to open stream: %s\n", res->name);
+		goto err;
+	}
+	return st;
+
+err:
+	free_stream(st);
+	return 0;
+}
+
+int resman_stream_start(struct stream *st)
+{
+	int res;
+
+	pthread_mutex_lock(&st->lock);
+	if((res = start_reader(st)) == -1) {
+		st->finished = 1;
+	}
+	pthread_mutex_unlock(&st->lock);
+
+	if(res == -1) {
+		finish(st);
+	}
+	return res;
+}
+
+int resman_stream_seek(struct stream *st, long long offs)
+{
+	int i;
+
+	pthread_mutex_lock(&st->lock);
+	if(st->finished || st->cancel) {
+		pthread_mutex_unlock(&st->lock);
+		return -1;
+	}
+
+	/* chunks already read, or being read, belong to the previous generation
+	 * and will be discarded. A chunk being consumed right now is allowed to
+	 * complete.
+	 */
+	st->gen++;
+	for(i=0; i<st->num_bufs; i++) {
+		if(st->bufs[i].state == BUF_FULL) {
+			st->bufs[i].state = BUF_FREE;
+		}
+	}
+	st->read_offs = offs;
+	st->read_seq = st->cons_seq = 0;
+	st->eof = 0;
+
+	if(!st->reading) {
+		start_reader(st);
+	}
+	pthread_mutex_unlock(&st->lock);
+	return 0;
+}
+
+/* there's always a job in flight until the stream is finished, and it will
+ * notice the cancel flag and finish the stream when it's done.
+ */
+void resman_stream_cancel(struct stream *st)
+{
+	pthread_mutex_lock(&st->lock);
+	st->cancel = 1;
+	pthread_mutex_unlock(&st->lock);
+}
+
+static void read_job(void *cls)
+{
+	struct stream *st = cls;
+	struct stream_buf *buf;
+	long long offs;
+	unsigned int gen;
+	long sz;
+	int done;
+
+	pthread_mutex_lock(&st->lock);
+	while(!st->eof && !st->cancel && (buf = find_buf(st, BUF_FREE, 0))) {
+		buf->state = BUF_READING;
+		buf->offs = offs = st->read_offs;
+		buf->seq = st->read_seq;
+		buf->gen = gen = st->gen;
+		pthread_mutex_unlock(&st->lock);
+
+		sz = read_at(st->fd, buf->data, st->chunk_size, offs);
+
+		pthread_mutex_lock(&st->lock);
+		if(gen != st->gen) {
+			/* a seek happened while we were reading, this chunk is useless */
+			buf->state = BUF_FREE;
+			continue;
+		}
+		if(sz < 0) {
+			buf->state = BUF_FREE;
+			st->error = 1;
+			st->cancel = 1;
+			break;
+		}
+
+		buf->size = sz;
+		buf->state = BUF_FULL;
+		st->read_offs += sz;
+		st->read_seq++;
+		if(sz < st->chunk_size) {
+			st->eof = 1;
+		}
+
+		if(!st->consuming) {
+			start_consumer(st);
+		}
+	}
+	st->reading = 0;
+	done = check_finished(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if(done) {
+		finish(st);
+	}
+}
+
+static void consume_job(void *cls)
+{
+	struct stream *st = cls;
+	struct stream_buf *buf;
+	int done, res;
+
+	pthread_mutex_lock(&st->lock);
+	while(!st->cancel && (buf = find_buf(st, BUF_FULL, st->cons_seq))) {
+		buf->state = BUF_CONSUMING;
+		pthread_mutex_unlock(&st->lock);
+
+		if(buf->size > 0) {
+			res = st->func(st->res->id, buf->data, buf->size, buf->offs, st->cls);
+		} else {
+			res = 0;	/* empty chunk at EOF */
+		}
+
+		pthread_mutex_lock(&st->lock);
+		buf->state = BUF_FREE;
+		if(res == -1) {
+			st->cancel = 1;
+			break;
+		}
+		if(buf->gen == st->gen) {
+			st->cons_seq++;
+		}
+
+		/* a buffer was freed, so the reader can carry on */
+		if(!st->reading && !st->eof) {
+			start_reader(st);
+		}
+	}
+	st->consuming = 0;
+	done = check_finished(st);
+	pthread_mutex_unlock(&st->lock);
+
+	if(done) {
+		finish(st);
+	}
+}
+
+/* called with the stream lock held */
+static int start_reader(struct stream *st)
+{
+	st->reading = 1;
+	if(resman_tpool_enqueue_client(st->rman->tpool, st->rman->tpool_client,
+				RESMAN_TPOOL_PRIO_NORMAL, st, read_job, 0) == -1) {
+		st->reading = 0;
+		st->error = st->cancel = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* called with the stream lock held */
+static int start_consumer(struct stream *st)
+{
+	st->consuming = 1;
+	if(resman_tpool_enqueue_client(st->rman->tpool, st->rman->tpool_client,
+				RESMAN_TPOOL_PRIO_NORMAL, st, consume_job, 0) == -1) {
+		st->consuming = 0;
+		st->error = st->cancel = 1;
+		return -1;
+	}
+	return 0;
+}
+
+/* returns 1 exactly once: when the stream is over, and no jobs are running.
+ * called with the stream lock held.
+ */
+static int check_finished(struct stream *st)
+{
+	if(st->finished || st->reading || st->consuming) {
+		return 0;
+	}
+	if(st->cancel || (st->eof && !find_buf(st, BUF_FULL, st->cons_seq))) {
+		st->finished = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static void finish(struct stream *st)
+{
+	struct resource *res = st->res;
+
+	pthread_mutex_lock(&st->rman->lock);
+	res->stream = 0;
+	pthread_mutex_unlock(&st->rman->lock);
+
+	res->result = st->error || (st->cancel && !st->eof) ? -1 : 0;
+	if(!RES_HAS_DONE(res->type) && res->result == -1 && res->num_loads == 0) {
+		/* same as a failed first load without a done callback: nobody else
+		 * would get rid of it.
+		 */
+		pthread_mutex_lock(&st->rman->res_lock);
+		resman_queue_delete(st->rman, res);
+		pthread_mutex_unlock(&st->rman->res_lock);
+	}
+	if(RES_HAS_DONE(res->type) && RES_FREE_THREADED(res)) {
+		resman_run_done(st->rman, res);
+		resman_update_state(res, RES_STATE_MASK | RES_PARTIAL, RES_DONE);
+	} else {
+		resman_update_state(res, RES_STATE_MASK | RES_PARTIAL,
+				RES_HAS_DONE(res->type) ? RES_LOADED : RES_DONE);
+	}
+
+	free_stream(st);
+}
+
+static void free_stream(struct stream *st)
+{
+	int i;
+
+	if(st->fd >= 0) {
+		close(st->fd);
+	}
+	if(st->bufs) {
+		for(i=0; i<st->num_bufs; i++) {
+			free(st->bufs[i].data);
+		}
+		free(st->bufs);
+	}
+	pthread_mutex_destroy(&st->lock);
+	free(st);
+}
+
+/* find a free buffer (state BUF_FREE), or the full buffer with a specific
+ * sequence number from the current seek generation (state BUF_FULL).
+ */
+static struct stream_buf *find_buf(struct stream *st, int state, unsigned int seq)
+{
+	int i;
+	struct stream_buf *buf = st->bufs;
+
+	for(i=0; i<st->num_bufs; i++) {
+		if(buf[i].state != state) continue;
+
+		if(state != BUF_FULL || (buf[i].seq == seq && buf[i].gen == st->gen)) {
+			return buf + i;
+		}
+	}
+	return 0;
+}
+
+/* read a whole chunk at an offset. Returns the number of bytes read, which is
+ * less than size only at the end of the file, or -1 on error.
+ */
+static long read_at(int fd, void *buf, long size, long long offs)
+{
+	long sz, total = 0;
+
+#if defined(WIN32) || defined(__WIN32__)
+	if(_lseeki64(fd, offs, SEEK_SET) == -1) {
+		return -1;
+	}
+#endif
+	while(total < size) {
+#if defined(WIN32) || defined(__WIN32__)
+		sz = read(fd, (char*)buf + total, size - total);
+#else
+		sz = pread(fd, (char*)buf + total, size - total, offs + total);
+#endif
+		if(sz == -1) {
+			return -1;
+		}
+		if(sz == 0) break;
+		total += sz;
+	}
+	return total;
+}
@@ -0,0 +1,39 @@
+/*
+libresman - a multithreaded resource data file manager.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RESMAN_STREAM_H_
+#define RESMAN_STREAM_H_
+
+#include "resman.h"
+
+struct resman;
+struct resource;
+struct stream;
+
+struct stream *resman_stream_create(struct resman *rman, struct resource *res,
+		resman_chunk_func func, void *cls, int chunk_size, int num_bufs);
+
+/* start reading the stream. The stream frees itself after completion, and
+ * marks the resource as done. The resman lock must be held while calling
+ * seek or cancel, to make sure the stream isn't freed in the meantime.
+ */
+int resman_stream_start(struct stream *st);
+
+int resman_stream_seek(struct stream *st, long long offs);
+void resman_stream_cancel(struct stream *st);
+
+#endif	/* RESMAN_STREAM_H_ */
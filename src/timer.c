@@ -22,6 +22,19 @@ unsigned long resman_get_time_msec(void)
 	}
 	return (ts.tv_sec - ts0.tv_sec) * 1000 + (ts.tv_nsec - ts0.tv_nsec) / 1000000;
 }
+
+unsigned long long resman_get_time_usec(void)
+{
+	struct timespec ts;
+	static struct timespec ts0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if(ts0.tv_sec == 0 && ts0.tv_nsec == 0) {
+		ts0 = ts;
+		return 0;
+	}
+	return (unsigned long long)(ts.tv_sec - ts0.tv_sec) * 1000000 + (ts.tv_nsec - ts0.tv_nsec) / 1000;
+}
 #else	/* no fancy POSIX clocks, fallback to good'ol gettimeofday */
 unsigned long resman_get_time_msec(void)
 {
@@ -35,6 +48,19 @@ unsigned long resman_get_time_msec(void)
 	}
 	return (tv.tv_sec - tv0.tv_sec) * 1000 + (tv.tv_usec - tv0.tv_usec) / 1000;
 }
+
+unsigned long long resman_get_time_usec(void)
+{
+	struct timeval tv;
+	static struct timeval tv0;
+
+	gettimeofday(&tv, 0);
+	if(tv0.tv_sec == 0 && tv0.tv_usec == 0) {
+		tv0 = tv;
+		return 0;
+	}
+	return (unsigned long long)(tv.tv_sec - tv0.tv_sec) * 1000000 + (tv.tv_usec - tv0.tv_usec);
+}
 #endif	/* !posix clock */
 
 #endif
@@ -47,4 +73,21 @@ unsigned long resman_get_time_msec(void)
 {
 	return timeGetTime();
 }
+
+unsigned long long resman_get_time_usec(void)
+{
+	LARGE_INTEGER t;
+	unsigned long long ticks;
+	static LARGE_INTEGER freq, t0;
+
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&t0);
+		return 0;
+	}
+	QueryPerformanceCounter(&t);
+	ticks = t.QuadPart - t0.QuadPart;
+	/* split it up to avoid overflowing the multiplication */
+	return ticks / freq.QuadPart * 1000000 + ticks % freq.QuadPart * 1000000 / freq.QuadPart;
+}
 #endif
@@ -2,5 +2,7 @@
 #define TIMER_H_
 
 unsigned long resman_get_time_msec(void);
+/* higher resolution timer, for measuring short callbacks */
+unsigned long long resman_get_time_usec(void);
 
 #endif	/* TIMER_H_ */
@@ -15,11 +15,24 @@ GNU Lesser General Public License for more details.
 You should have received a copy of the GNU Lesser General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#ifdef __linux__
+#define _GNU_SOURCE	/* for pthread_setaffinity_np and SCHED_BATCH/SCHED_IDLE */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <pthread.h>
 #include "tpool.h"
+#include "resman.h"
+#include "timer.h"
+#include "mempool.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 
 #if defined(__APPLE__) && defined(__MACH__)
 # ifndef __unix__
@@ -47,15 +60,110 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 struct work_item {
 	void *data;
 	resman_tpool_callback work, done;
+	struct resman_tpool_client *client;
+	struct resman_tpool_group *group;
 	struct work_item *next;
 };
 
-struct resman_thread_pool {
-	pthread_t *threads;
-	int num_threads;
+/* a set of jobs which can be waited on together, without waiting for any
+ * unrelated jobs in the pool. Protected by the work queue mutex.
+ */
+struct resman_tpool_group {
+	struct resman_thread_pool *tpool;
+	struct resman_tpool_client *client;
+	int pending;	/* queued or running jobs of this group */
+};
+
+/* each user of the pool gets its own set of work queues. Workers pick which
+ * client to serve next with deficit round-robin: every time a client's turn
+ * comes up, its deficit is credited with its weight, and each job it runs
+ * costs one unit. Clients with fewer active jobs than their guaranteed
+ * minimum are served before anyone else.
+ */
+struct resman_tpool_client {
+	int weight;
+	int min_workers;
+	int deficit;
 
 	int qsize;
-	struct work_item *workq, *workq_tail;
+	/* one work queue per priority level */
+	struct work_item *workq[RESMAN_TPOOL_NUM_PRIO], *workq_tail[RESMAN_TPOOL_NUM_PRIO];
+
+	int nactive;	/* jobs of this client currently running */
+	int removed;	/* removed while jobs were running, free when they're done */
+
+	struct resman_tpool_client *next;	/* circular list */
+};
+
+enum { WORKER_NONE, WORKER_RUNNING, WORKER_EXITED, WORKER_JOINING };
+
+#define SCRATCH_ALIGN	16
+
+/* per-worker bump allocator, reset after every job. Requests which don't fit
+ * get a separate block, and the main buffer grows to the high water mark on
+ * the next reset, so that steady-state jobs never call malloc.
+ */
+struct scratch_block {
+	struct scratch_block *next;
+};
+
+struct scratch {
+	char *buf;
+	unsigned long size, used;
+	unsigned long overflow;		/* bytes allocated in extra blocks since the last reset */
+	struct scratch_block *blocks;
+};
+
+struct worker {
+	struct resman_thread_pool *tpool;
+	pthread_t thread;
+	int state;
+
+	/* start of the current job, wall clock and thread CPU time in msec */
+	int busy;
+	unsigned long job_start;
+	long job_cpu_start;
+
+	void *user_data;	/* returned by the thread init hook */
+	struct scratch scratch;
+};
+
+/* shared state of a parallel_for call. The range is split in chunks of grain
+ * indices, and the caller, and any workers which pick up one of the helper
+ * jobs, keep grabbing the next chunk until there are none left.
+ */
+struct parfor {
+	resman_tpool_range_func func;
+	void *cls;
+	int next, end, grain;
+	int running;	/* chunks being processed right now */
+
+	int nref;		/* the caller plus one for each helper job */
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+};
+
+struct resman_thread_pool {
+	struct worker *workers;	/* max_threads slots */
+	int num_threads;		/* running worker threads */
+	int min_threads, max_threads;
+	struct resman_pool_attr attr;
+	unsigned long long cpu_mask;	/* CPUs the workers are restricted to (0: any) */
+
+	/* elastic pools only: the monitor thread watches for blocked workers */
+	int elastic;
+	pthread_t monitor;
+	int monitor_running;
+	pthread_cond_t monitor_condvar;
+
+	unsigned long spawned, retired;
+	pthread_attr_t thr_attr;
+
+	int qsize;	/* total queued jobs of all clients */
+	struct resman_tpool_client defclient;	/* used by the plain enqueue calls */
+	struct resman_tpool_client *cur_client;	/* round-robin position */
+	/* subtasks of running jobs (parallel_for helpers), served before anything else */
+	struct resman_tpool_client subclient;
 	pthread_mutex_t workq_mutex;
 	pthread_cond_t workq_condvar;
 
@@ -76,43 +184,133 @@ struct resman_thread_pool {
 };
 
 static void *thread_func(void *args);
+static void *monitor_func(void *args);
+static int spawn_worker(struct resman_thread_pool *tpool);
+static void setup_thread(struct resman_thread_pool *tpool);
+static unsigned long long calc_cpu_mask(const struct resman_pool_attr *attr);
+static int caller_cpu(void);
+static void abs_timeout(struct timespec *ts, long msec);
+static void make_worker_key(void);
+static void *scratch_alloc(struct scratch *s, unsigned long size);
+static void scratch_reset(struct scratch *s);
+static void scratch_destroy(struct scratch *s);
+static long thread_cpu_msec(pthread_t thread);
 static void send_done_event(struct resman_thread_pool *tpool);
+static struct work_item *dequeue(struct resman_thread_pool *tpool);
+static int enqueue(struct resman_thread_pool *tpool, struct resman_tpool_client *client,
+		struct resman_tpool_group *group, int prio, void *data, resman_tpool_callback work_func,
+		resman_tpool_callback done_func);
+static void parfor_job(void *cls);
+static int parfor_run(struct parfor *pf);
+static void parfor_release(struct parfor *pf);
+static struct work_item *client_dequeue(struct resman_tpool_client *client);
+static void clear_client(struct resman_tpool_client *client);
 
 static struct work_item *alloc_work_item(void);
 static void free_work_item(struct work_item *w);
 
+static pthread_key_t worker_key;
+static pthread_once_t worker_key_once = PTHREAD_ONCE_INIT;
+
+
+void resman_pool_attr_init(struct resman_pool_attr *attr)
+{
+	memset(attr, 0, sizeof *attr);
+	attr->sched_class = RESMAN_SCHED_DEFAULT;
+	attr->exclude_cpu = -1;
+	attr->idle_timeout = 5000;
+	attr->block_timeout = 100;
+}
 
 struct resman_thread_pool *resman_tpool_create(int num_threads)
 {
-	int i;
+	struct resman_pool_attr attr;
+
+	resman_pool_attr_init(&attr);
+	attr.num_threads = num_threads;
+	return resman_tpool_create_attr(&attr);
+}
+
+struct resman_thread_pool *resman_tpool_create_attr(const struct resman_pool_attr *attr)
+{
+	int i, num_threads;
 	struct resman_thread_pool *tpool;
 
+	pthread_once(&worker_key_once, make_worker_key);
+
 	if(!(tpool = calloc(1, sizeof *tpool))) {
 		return 0;
 	}
+	if(attr) {
+		tpool->attr = *attr;
+	} else {
+		resman_pool_attr_init(&tpool->attr);
+	}
+
+	tpool->defclient.weight = 1;
+	tpool->defclient.next = &tpool->defclient;
+	tpool->subclient.weight = 1;
+	tpool->subclient.next = &tpool->subclient;
+	tpool->cur_client = &tpool->defclient;
+
 	pthread_mutex_init(&tpool->workq_mutex, 0);
 	pthread_cond_init(&tpool->workq_condvar, 0);
 	pthread_cond_init(&tpool->done_condvar, 0);
+	pthread_cond_init(&tpool->monitor_condvar, 0);
 
 #if !defined(WIN32) && !defined(__WIN32__)
 	tpool->wait_pipe[0] = tpool->wait_pipe[1] = -1;
 #endif
 
-	if(num_threads <= 0) {
+	/* the pool starts with num_threads workers, and if max_threads is larger
+	 * than min_threads, it can grow and shrink between the two.
+	 */
+	if((num_threads = tpool->attr.num_threads) <= 0) {
 		num_threads = resman_tpool_num_processors();
 	}
-	tpool->num_threads = num_threads;
+	if((tpool->min_threads = tpool->attr.min_threads) <= 0) {
+		tpool->min_threads = num_threads;
+	} else if(num_threads < tpool->min_threads) {
+		num_threads = tpool->min_threads;
+	}
+	if((tpool->max_threads = tpool->attr.max_threads) < num_threads) {
+		tpool->max_threads = num_threads;
+	}
+	tpool->elastic = tpool->max_threads > tpool->min_threads;
+
+	tpool->cpu_mask = calc_cpu_mask(&tpool->attr);
 
-	if(!(tpool->threads = calloc(num_threads, sizeof *tpool->threads))) {
+	if(!(tpool->workers = calloc(tpool->max_threads, sizeof *tpool->workers))) {
 		free(tpool);
 		return 0;
 	}
+	for(i=0; i<tpool->max_threads; i++) {
+		tpool->workers[i].tpool = tpool;
+	}
+
+	pthread_attr_init(&tpool->thr_attr);
+	if(tpool->attr.stack_size > 0) {
+		if(pthread_attr_setstacksize(&tpool->thr_attr, tpool->attr.stack_size) != 0) {
+			fprintf(stderr, "resman_thread_pool: invalid stack size: %lu\n", tpool->attr.stack_size);
+		}
+	}
+
+	pthread_mutex_lock(&tpool->workq_mutex);
 	for(i=0; i<num_threads; i++) {
-		if(pthread_create(tpool->threads + i, 0, thread_func, tpool) == -1) {
-			/*tpool->threads[i] = 0;*/
+		if(spawn_worker(tpool) == -1) {
+			pthread_mutex_unlock(&tpool->workq_mutex);
+			resman_tpool_destroy(tpool);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	if(tpool->elastic) {
+		if(pthread_create(&tpool->monitor, 0, monitor_func, tpool) != 0) {
 			resman_tpool_destroy(tpool);
 			return 0;
 		}
+		tpool->monitor_running = 1;
 	}
 	return tpool;
 }
@@ -123,22 +321,35 @@ void resman_tpool_destroy(struct resman_thread_pool *tpool)
 	if(!tpool) return;
 
 	resman_tpool_clear(tpool);
-	tpool->should_quit = 1;
 
+	pthread_mutex_lock(&tpool->workq_mutex);
+	tpool->should_quit = 1;
 	pthread_cond_broadcast(&tpool->workq_condvar);
+	pthread_cond_broadcast(&tpool->monitor_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
 
-	if(tpool->threads) {
+	if(tpool->monitor_running) {
+		pthread_join(tpool->monitor, 0);
+	}
+
+	if(tpool->workers) {
 		printf("resman_thread_pool: waiting for %d worker threads to stop ", tpool->num_threads);
 		fflush(stdout);
 
-		for(i=0; i<tpool->num_threads; i++) {
-			pthread_join(tpool->threads[i], 0);
-			putchar('.');
-			fflush(stdout);
+		/* no new workers can be spawned after should_quit is set */
+		for(i=0; i<tpool->max_threads; i++) {
+			if(tpool->workers[i].state == WORKER_NONE) continue;
+
+			pthread_join(tpool->workers[i].thread, 0);
+			if(tpool->workers[i].state == WORKER_RUNNING) {
+				putchar('.');
+				fflush(stdout);
+			}
 		}
 		putchar('\n');
-		free(tpool->threads);
+		free(tpool->workers);
 	}
+	pthread_attr_destroy(&tpool->thr_attr);
 
 	/* also wake up anyone waiting on the resman_wait* calls */
 	tpool->nactive = 0;
@@ -148,6 +359,7 @@ void resman_tpool_destroy(struct resman_thread_pool *tpool)
 	pthread_mutex_destroy(&tpool->workq_mutex);
 	pthread_cond_destroy(&tpool->workq_condvar);
 	pthread_cond_destroy(&tpool->done_condvar);
+	pthread_cond_destroy(&tpool->monitor_condvar);
 
 #if defined(WIN32) || defined(__WIN32__)
 	if(tpool->wait_event) {
@@ -159,6 +371,7 @@ void resman_tpool_destroy(struct resman_thread_pool *tpool)
 		close(tpool->wait_pipe[1]);
 	}
 #endif
+	free(tpool);
 }
 
 int resman_tpool_addref(struct resman_thread_pool *tpool)
@@ -188,24 +401,55 @@ void resman_tpool_end_batch(struct resman_thread_pool *tpool)
 
 int resman_tpool_enqueue(struct resman_thread_pool *tpool, void *data,
 		resman_tpool_callback work_func, resman_tpool_callback done_func)
+{
+	return resman_tpool_enqueue_prio(tpool, RESMAN_TPOOL_PRIO_NORMAL, data, work_func, done_func);
+}
+
+int resman_tpool_enqueue_prio(struct resman_thread_pool *tpool, int prio, void *data,
+		resman_tpool_callback work_func, resman_tpool_callback done_func)
+{
+	return resman_tpool_enqueue_client(tpool, 0, prio, data, work_func, done_func);
+}
+
+int resman_tpool_enqueue_client(struct resman_thread_pool *tpool, struct resman_tpool_client *client,
+		int prio, void *data, resman_tpool_callback work_func, resman_tpool_callback done_func)
+{
+	if(!client) {
+		client = &tpool->defclient;
+	}
+	return enqueue(tpool, client, 0, prio, data, work_func, done_func);
+}
+
+static int enqueue(struct resman_thread_pool *tpool, struct resman_tpool_client *client,
+		struct resman_tpool_group *group, int prio, void *data, resman_tpool_callback work_func,
+		resman_tpool_callback done_func)
 {
 	struct work_item *job;
 
+	if(prio < 0) prio = 0;
+	if(prio >= RESMAN_TPOOL_NUM_PRIO) prio = RESMAN_TPOOL_NUM_PRIO - 1;
+
 	if(!(job = alloc_work_item())) {
 		return -1;
 	}
 	job->work = work_func;
 	job->done = done_func;
 	job->data = data;
+	job->client = client;
+	job->group = group;
 	job->next = 0;
 
 	pthread_mutex_lock(&tpool->workq_mutex);
-	if(tpool->workq) {
-		tpool->workq_tail->next = job;
-		tpool->workq_tail = job;
+	if(group) {
+		++group->pending;
+	}
+	if(client->workq[prio]) {
+		client->workq_tail[prio]->next = job;
+		client->workq_tail[prio] = job;
 	} else {
-		tpool->workq = tpool->workq_tail = job;
+		client->workq[prio] = client->workq_tail[prio] = job;
 	}
+	++client->qsize;
 	++tpool->qsize;
 	pthread_mutex_unlock(&tpool->workq_mutex);
 
@@ -215,16 +459,265 @@ int resman_tpool_enqueue(struct resman_thread_pool *tpool, void *data,
 	return 0;
 }
 
+int resman_tpool_parallel_for(struct resman_thread_pool *tpool, int start, int end, int grain,
+		resman_tpool_range_func func, void *cls)
+{
+	int i, num_helpers;
+	long long num, num_chunks;
+	struct parfor *pf;
+
+	if(end <= start) {
+		return 0;
+	}
+	/* the size of the range may not fit in an int */
+	num = (long long)end - start;
+
+	if(grain <= 0) {
+		/* a few chunks per thread, to even out the load */
+		if((grain = num / (tpool->num_threads * 4)) < 1) {
+			grain = 1;
+		}
+	}
+	num_chunks = num / grain + (num % grain != 0);
+
+	/* no point in involving the other workers for a single chunk */
+	if(num_chunks - 1 > tpool->num_threads) {
+		num_helpers = tpool->num_threads;
+	} else {
+		num_helpers = num_chunks - 1;
+	}
+	if(num_helpers <= 0 || !(pf = calloc(1, sizeof *pf))) {
+		func(start, end, cls);
+		return 0;
+	}
+	pf->func = func;
+	pf->cls = cls;
+	pf->next = start;
+	pf->end = end;
+	pf->grain = grain;
+	pf->nref = 1;
+	pthread_mutex_init(&pf->lock, 0);
+	pthread_cond_init(&pf->done_cond, 0);
+
+	for(i=0; i<num_helpers; i++) {
+		pthread_mutex_lock(&pf->lock);
+		pf->nref++;
+		pthread_mutex_unlock(&pf->lock);
+
+		if(enqueue(tpool, &tpool->subclient, 0, RESMAN_TPOOL_PRIO_URGENT, pf, parfor_job, 0) == -1) {
+			pthread_mutex_lock(&pf->lock);
+			pf->nref--;
+			pthread_mutex_unlock(&pf->lock);
+			break;
+		}
+	}
+
+	/* the caller works on the range too, instead of just waiting for it. Then
+	 * it only has to wait for chunks which other threads are already running,
+	 * so it can't deadlock even if every worker is blocked in a parallel_for.
+	 */
+	parfor_run(pf);
+
+	pthread_mutex_lock(&pf->lock);
+	while(pf->running > 0) {
+		pthread_cond_wait(&pf->done_cond, &pf->lock);
+	}
+	pthread_mutex_unlock(&pf->lock);
+
+	parfor_release(pf);
+	return 0;
+}
+
+static void parfor_job(void *cls)
+{
+	struct parfor *pf = cls;
+
+	parfor_run(pf);
+	parfor_release(pf);
+}
+
+/* process chunks until there are none left. Returns the number of chunks processed */
+static int parfor_run(struct parfor *pf)
+{
+	int begin, end, count = 0;
+
+	pthread_mutex_lock(&pf->lock);
+	while(pf->next < pf->end) {
+		begin = pf->next;
+		end = (long long)pf->end - begin > pf->grain ? begin + pf->grain : pf->end;
+		pf->next = end;
+		pf->running++;
+		pthread_mutex_unlock(&pf->lock);
+
+		pf->func(begin, end, pf->cls);
+		count++;
+
+		pthread_mutex_lock(&pf->lock);
+		if(--pf->running == 0 && pf->next >= pf->end) {
+			pthread_cond_signal(&pf->done_cond);
+		}
+	}
+	pthread_mutex_unlock(&pf->lock);
+	return count;
+}
+
+static void parfor_release(struct parfor *pf)
+{
+	int nref;
+
+	pthread_mutex_lock(&pf->lock);
+	nref = --pf->nref;
+	pthread_mutex_unlock(&pf->lock);
+
+	if(nref == 0) {
+		pthread_mutex_destroy(&pf->lock);
+		pthread_cond_destroy(&pf->done_cond);
+		free(pf);
+	}
+}
+
+struct resman_tpool_group *resman_tpool_create_group(struct resman_thread_pool *tpool,
+		struct resman_tpool_client *client)
+{
+	struct resman_tpool_group *group;
+
+	if(!(group = calloc(1, sizeof *group))) {
+		return 0;
+	}
+	group->tpool = tpool;
+	group->client = client ? client : &tpool->defclient;
+	return group;
+}
+
+void resman_tpool_destroy_group(struct resman_tpool_group *group)
+{
+	if(!group) return;
+
+	resman_tpool_group_wait(group);
+	free(group);
+}
+
+int resman_tpool_enqueue_group(struct resman_tpool_group *group, int prio, void *data,
+		resman_tpool_callback work_func, resman_tpool_callback done_func)
+{
+	if(prio < 0) prio = 0;
+	if(prio >= RESMAN_TPOOL_NUM_PRIO) prio = RESMAN_TPOOL_NUM_PRIO - 1;
+
+	return enqueue(group->tpool, group->client, group, prio, data, work_func, done_func);
+}
+
+int resman_tpool_group_pending(struct resman_tpool_group *group)
+{
+	int res;
+	pthread_mutex_lock(&group->tpool->workq_mutex);
+	res = group->pending;
+	pthread_mutex_unlock(&group->tpool->workq_mutex);
+	return res;
+}
+
+void resman_tpool_group_wait(struct resman_tpool_group *group)
+{
+	struct resman_thread_pool *tpool = group->tpool;
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	while(group->pending) {
+		pthread_cond_wait(&tpool->done_condvar, &tpool->workq_mutex);
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+}
+
+long resman_tpool_group_timedwait(struct resman_tpool_group *group, long timeout)
+{
+	struct timespec tout;
+	unsigned long start = resman_get_time_msec();
+	struct resman_thread_pool *tpool = group->tpool;
+
+	abs_timeout(&tout, timeout);
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	while(group->pending) {
+		if(pthread_cond_timedwait(&tpool->done_condvar, &tpool->workq_mutex, &tout) == ETIMEDOUT) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	return (long)(resman_get_time_msec() - start);
+}
+
 void resman_tpool_clear(struct resman_thread_pool *tpool)
 {
+	struct resman_tpool_client *client;
+
 	pthread_mutex_lock(&tpool->workq_mutex);
-	while(tpool->workq) {
-		void *tmp = tpool->workq;
-		tpool->workq = tpool->workq->next;
-		free(tmp);
+	client = &tpool->defclient;
+	do {
+		clear_client(client);
+		client = client->next;
+	} while(client != &tpool->defclient);
+	/* subtasks are left alone, the jobs which spawned them depend on them */
+	tpool->qsize = tpool->subclient.qsize;
+	/* wake up anyone waiting on a group which just lost its jobs */
+	pthread_cond_broadcast(&tpool->done_condvar);
+	pthread_mutex_unlock(&tpool->workq_mutex);
+}
+
+struct resman_tpool_client *resman_tpool_add_client(struct resman_thread_pool *tpool,
+		int weight, int min_workers)
+{
+	struct resman_tpool_client *client;
+
+	if(!(client = calloc(1, sizeof *client))) {
+		return 0;
 	}
-	tpool->workq = tpool->workq_tail = 0;
-	tpool->qsize = 0;
+	client->weight = weight > 0 ? weight : 1;
+	client->min_workers = min_workers > 0 ? min_workers : 0;
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	client->next = tpool->defclient.next;
+	tpool->defclient.next = client;
+	pthread_mutex_unlock(&tpool->workq_mutex);
+	return client;
+}
+
+void resman_tpool_remove_client(struct resman_thread_pool *tpool, struct resman_tpool_client *client)
+{
+	struct resman_tpool_client *prev;
+
+	if(!client || client == &tpool->defclient) return;
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	prev = &tpool->defclient;
+	while(prev->next != client) {
+		prev = prev->next;
+	}
+	prev->next = client->next;
+	if(tpool->cur_client == client) {
+		tpool->cur_client = client->next;
+	}
+
+	tpool->qsize -= client->qsize;
+	clear_client(client);
+	pthread_cond_broadcast(&tpool->done_condvar);
+
+	if(client->nactive) {
+		client->removed = 1;	/* the last worker to finish a job of this client frees it */
+		client = 0;
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+
+	free(client);
+}
+
+void resman_tpool_set_client_share(struct resman_thread_pool *tpool,
+		struct resman_tpool_client *client, int weight, int min_workers)
+{
+	if(!client) {
+		client = &tpool->defclient;
+	}
+	pthread_mutex_lock(&tpool->workq_mutex);
+	client->weight = weight > 0 ? weight : 1;
+	client->min_workers = min_workers > 0 ? min_workers : 0;
 	pthread_mutex_unlock(&tpool->workq_mutex);
 }
 
@@ -362,25 +855,76 @@ static void send_done_event(struct resman_thread_pool *tpool)
 }
 #endif	/* WIN32/UNIX */
 
+void resman_tpool_notify(struct resman_thread_pool *tpool)
+{
+	pthread_mutex_lock(&tpool->workq_mutex);
+	send_done_event(tpool);
+	pthread_mutex_unlock(&tpool->workq_mutex);
+}
+
+int resman_tpool_get_stats(struct resman_thread_pool *tpool, struct resman_pool_stats *stats)
+{
+	pthread_mutex_lock(&tpool->workq_mutex);
+	stats->num_threads = tpool->num_threads;
+	stats->min_threads = tpool->min_threads;
+	stats->max_threads = tpool->max_threads;
+	stats->active = tpool->nactive;
+	stats->queued = tpool->qsize;
+	stats->spawned = tpool->spawned;
+	stats->retired = tpool->retired;
+	pthread_mutex_unlock(&tpool->workq_mutex);
+	return 0;
+}
+
 static void *thread_func(void *args)
 {
-	struct resman_thread_pool *tpool = args;
+	struct worker *self = args;
+	struct resman_thread_pool *tpool = self->tpool;
+	struct timespec tout;
+
+	setup_thread(tpool);
+
+	pthread_setspecific(worker_key, self);
+	if(tpool->attr.scratch_size > 0 && (self->scratch.buf = malloc(tpool->attr.scratch_size))) {
+		self->scratch.size = tpool->attr.scratch_size;
+	}
+	if(tpool->attr.thread_init) {
+		self->user_data = tpool->attr.thread_init(tpool->attr.thread_cls);
+	}
 
 	pthread_mutex_lock(&tpool->workq_mutex);
 	while(!tpool->should_quit) {
-		if(!tpool->workq) {
-			pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
+		if(!tpool->qsize) {
+			if(tpool->elastic && tpool->num_threads > tpool->min_threads) {
+				/* surplus workers retire if they stay idle for too long */
+				abs_timeout(&tout, tpool->attr.idle_timeout);
+				if(pthread_cond_timedwait(&tpool->workq_condvar, &tpool->workq_mutex, &tout) == ETIMEDOUT &&
+						!tpool->qsize && tpool->num_threads > tpool->min_threads) {
+					self->state = WORKER_EXITED;
+					--tpool->num_threads;
+					++tpool->retired;
+					break;
+				}
+			} else {
+				pthread_cond_wait(&tpool->workq_condvar, &tpool->workq_mutex);
+			}
 			if(tpool->should_quit) break;
 		}
 
-		while(!tpool->should_quit && tpool->workq) {
-			/* grab the first job */
-			struct work_item *job = tpool->workq;
-			tpool->workq = tpool->workq->next;
-			if(!tpool->workq)
-				tpool->workq_tail = 0;
+		while(!tpool->should_quit && tpool->qsize) {
+			/* grab the next job */
+			struct work_item *job = dequeue(tpool);
+			struct resman_tpool_client *client = job->client;
+			struct resman_tpool_group *group = job->group;
 			++tpool->nactive;
 			--tpool->qsize;
+			++client->nactive;
+
+			if(tpool->elastic) {
+				self->busy = 1;
+				self->job_start = resman_get_time_msec();
+				self->job_cpu_start = thread_cpu_msec(pthread_self());
+			}
 			pthread_mutex_unlock(&tpool->workq_mutex);
 
 			/* do the job */
@@ -389,8 +933,16 @@ static void *thread_func(void *args)
 				job->done(job->data);
 			}
 			free_work_item(job);
+			scratch_reset(&self->scratch);
 
 			pthread_mutex_lock(&tpool->workq_mutex);
+			self->busy = 0;
+			if(--client->nactive == 0 && client->removed) {
+				free(client);
+			}
+			if(group) {
+				--group->pending;
+			}
 			/* notify everyone interested that we're done with this job */
 			pthread_cond_broadcast(&tpool->done_condvar);
 			send_done_event(tpool);
@@ -399,9 +951,432 @@ static void *thread_func(void *args)
 	}
 	pthread_mutex_unlock(&tpool->workq_mutex);
 
+	if(tpool->attr.thread_exit) {
+		tpool->attr.thread_exit(self->user_data, tpool->attr.thread_cls);
+	}
+	self->user_data = 0;
+	scratch_destroy(&self->scratch);
+	pthread_setspecific(worker_key, 0);
+	return 0;
+}
+
+void *resman_worker_scratch(unsigned long size)
+{
+	struct worker *self;
+
+	pthread_once(&worker_key_once, make_worker_key);
+	if(!(self = pthread_getspecific(worker_key))) {
+		return 0;	/* not called from a worker thread */
+	}
+	return scratch_alloc(&self->scratch, size);
+}
+
+void *resman_worker_data(void)
+{
+	struct worker *self;
+
+	pthread_once(&worker_key_once, make_worker_key);
+	if(!(self = pthread_getspecific(worker_key))) {
+		return 0;
+	}
+	return self->user_data;
+}
+
+static void make_worker_key(void)
+{
+	pthread_key_create(&worker_key, 0);
+}
+
+static void *scratch_alloc(struct scratch *s, unsigned long size)
+{
+	struct scratch_block *blk;
+	unsigned long hdr_size = (sizeof *blk + SCRATCH_ALIGN - 1) & ~(unsigned long)(SCRATCH_ALIGN - 1);
+	char *ptr;
+
+	size = (size + SCRATCH_ALIGN - 1) & ~(unsigned long)(SCRATCH_ALIGN - 1);
+
+	if(s->used + size <= s->size) {
+		ptr = s->buf + s->used;
+		s->used += size;
+		return ptr;
+	}
+
+	/* doesn't fit, allocate an overflow block, freed on the next reset */
+	if(!(blk = malloc(hdr_size + size))) {
+		return 0;
+	}
+	blk->next = s->blocks;
+	s->blocks = blk;
+	s->overflow += size;
+	return (char*)blk + hdr_size;
+}
+
+static void scratch_reset(struct scratch *s)
+{
+	unsigned long newsz;
+	char *tmp;
+
+	if(s->blocks) {
+		while(s->blocks) {
+			struct scratch_block *blk = s->blocks;
+			s->blocks = blk->next;
+			free(blk);
+		}
+
+		/* grow the buffer to fit everything the last job needed */
+		newsz = s->used + s->overflow;
+		if(newsz > s->size) {
+			if((tmp = malloc(newsz))) {
+				free(s->buf);
+				s->buf = tmp;
+				s->size = newsz;
+			}
+		}
+		s->overflow = 0;
+	}
+	s->used = 0;
+}
+
+static void scratch_destroy(struct scratch *s)
+{
+	scratch_reset(s);
+	free(s->buf);
+	memset(s, 0, sizeof *s);
+}
+
+
+/* the monitor thread of elastic pools. It periodically checks if there are
+ * jobs waiting, while all the workers are stuck in jobs which have been going
+ * on for a while without using much CPU time (i.e. they're blocked on I/O),
+ * and starts another worker if so.
+ */
+static void *monitor_func(void *args)
+{
+	int i, blocked;
+	long wall, cpu;
+	unsigned long now;
+	struct timespec tout;
+	struct resman_thread_pool *tpool = args;
+	long interval = tpool->attr.block_timeout / 2;
+
+	if(interval < 1) interval = 1;
+
+	pthread_mutex_lock(&tpool->workq_mutex);
+	while(!tpool->should_quit) {
+		abs_timeout(&tout, interval);
+		pthread_cond_timedwait(&tpool->monitor_condvar, &tpool->workq_mutex, &tout);
+		if(tpool->should_quit) break;
+
+		if(!tpool->qsize || tpool->nactive < tpool->num_threads ||
+				tpool->num_threads >= tpool->max_threads) {
+			continue;
+		}
+
+		now = resman_get_time_msec();
+		blocked = 0;
+		for(i=0; i<tpool->max_threads; i++) {
+			struct worker *w = tpool->workers + i;
+			if(w->state != WORKER_RUNNING || !w->busy) continue;
+
+			wall = (long)(now - w->job_start);
+			if(wall < tpool->attr.block_timeout) continue;
+
+			/* if we can't tell how much CPU time it used, assume blocked */
+			if((cpu = thread_cpu_msec(w->thread)) == -1 || w->job_cpu_start == -1 ||
+					cpu - w->job_cpu_start < wall / 2) {
+				blocked++;
+			}
+		}
+
+		if(blocked) {
+			spawn_worker(tpool);
+		}
+	}
+	pthread_mutex_unlock(&tpool->workq_mutex);
+	return 0;
+}
+
+/* start a new worker thread in a free slot. called with the work queue mutex
+ * held, which is dropped while joining a retired worker.
+ */
+static int spawn_worker(struct resman_thread_pool *tpool)
+{
+	int i;
+	struct worker *w;
+
+again:
+	if(tpool->should_quit || tpool->num_threads >= tpool->max_threads) {
+		return -1;
+	}
+	w = 0;
+	for(i=0; i<tpool->max_threads; i++) {
+		int st = tpool->workers[i].state;
+		if(st == WORKER_NONE || st == WORKER_EXITED) {
+			w = tpool->workers + i;
+			break;
+		}
+	}
+	if(!w) return -1;
+
+	if(w->state == WORKER_EXITED) {
+		/* a retired worker may still be running its exit hook, so join it
+		 * without the lock, and start over since anything could have changed
+		 * in the meantime. The slot is reserved until then.
+		 */
+		w->state = WORKER_JOINING;
+		pthread_mutex_unlock(&tpool->workq_mutex);
+		pthread_join(w->thread, 0);
+		pthread_mutex_lock(&tpool->workq_mutex);
+		w->state = WORKER_NONE;
+		goto again;
+	}
+	w->busy = 0;
+
+	if(pthread_create(&w->thread, &tpool->thr_attr, thread_func, w) != 0) {
+		return -1;
+	}
+	w->state = WORKER_RUNNING;
+	++tpool->num_threads;
+	++tpool->spawned;
+	return 0;
+}
+
+/* apply the scheduling class and CPU affinity of the pool to the calling
+ * worker thread. Failures are not fatal, the thread just runs unrestricted.
+ */
+static void setup_thread(struct resman_thread_pool *tpool)
+{
+	struct resman_pool_attr *attr = &tpool->attr;
+#if defined(__linux__)
+	int i;
+	cpu_set_t cpus;
+	struct sched_param param;
+
+	if(attr->sched_class == RESMAN_SCHED_BATCH || attr->sched_class == RESMAN_SCHED_IDLE) {
+		memset(&param, 0, sizeof param);
+		pthread_setschedparam(pthread_self(), attr->sched_class == RESMAN_SCHED_BATCH ?
+				SCHED_BATCH : SCHED_IDLE, &param);
+	}
+	if(attr->nice) {
+		/* on linux the nice value is per-thread, relative to the process */
+		pid_t tid = syscall(SYS_gettid);
+		errno = 0;
+		i = getpriority(PRIO_PROCESS, 0);
+		if(errno == 0) {
+			setpriority(PRIO_PROCESS, tid, i + attr->nice);
+		}
+	}
+	if(tpool->cpu_mask) {
+		CPU_ZERO(&cpus);
+		for(i=0; i<64; i++) {
+			if(tpool->cpu_mask & (1ull << i)) {
+				CPU_SET(i, &cpus);
+			}
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	}
+
+#elif defined(WIN32) || defined(__WIN32__)
+	if(attr->sched_class == RESMAN_SCHED_BATCH) {
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+	} else if(attr->sched_class == RESMAN_SCHED_IDLE) {
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+	} else if(attr->nice) {
+		/* windows only has a few discrete thread priority levels */
+		int prio;
+		if(attr->nice >= 10) {
+			prio = THREAD_PRIORITY_LOWEST;
+		} else if(attr->nice > 0) {
+			prio = THREAD_PRIORITY_BELOW_NORMAL;
+		} else if(attr->nice <= -10) {
+			prio = THREAD_PRIORITY_HIGHEST;
+		} else {
+			prio = THREAD_PRIORITY_ABOVE_NORMAL;
+		}
+		SetThreadPriority(GetCurrentThread(), prio);
+	}
+	if(tpool->cpu_mask) {
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)tpool->cpu_mask);
+	}
+#else
+	(void)attr;	/* not supported on this platform */
+#endif
+}
+
+/* figure out the set of CPUs the workers should run on, from the affinity
+ * mask and the excluded CPU. Returns 0 if they shouldn't be restricted.
+ */
+static unsigned long long calc_cpu_mask(const struct resman_pool_attr *attr)
+{
+	int cpu, num_cpus;
+	unsigned long long mask = attr->affinity;
+
+	if(attr->exclude_cpu == -1) {
+		return mask;
+	}
+
+	if((cpu = attr->exclude_cpu) == RESMAN_CPU_CALLER && (cpu = caller_cpu()) == -1) {
+		return mask;
+	}
+	if(cpu < 0 || cpu >= 64) {
+		return mask;
+	}
+
+	if(!mask) {
+		num_cpus = resman_tpool_num_processors();
+		mask = num_cpus >= 64 ? ~0ull : (1ull << num_cpus) - 1;
+	}
+	mask &= ~(1ull << cpu);
+	return mask;	/* if nothing's left, don't restrict anything */
+}
+
+/* the CPU the calling thread is bound to, or if it's not bound to a single
+ * CPU, the one it's running on right now. -1 if we can't tell.
+ */
+static int caller_cpu(void)
+{
+#if defined(__linux__)
+	int i, cpu = -1;
+	cpu_set_t cpus;
+
+	if(pthread_getaffinity_np(pthread_self(), sizeof cpus, &cpus) == 0 && CPU_COUNT(&cpus) == 1) {
+		for(i=0; i<CPU_SETSIZE; i++) {
+			if(CPU_ISSET(i, &cpus)) {
+				cpu = i;
+				break;
+			}
+		}
+		return cpu;
+	}
+	return sched_getcpu();
+#elif defined(WIN32) || defined(__WIN32__)
+	return GetCurrentProcessorNumber();
+#else
+	return -1;
+#endif
+}
+
+/* pick the client to serve next, and remove its next job.
+ * called with the work queue mutex held, and qsize > 0
+ */
+static struct work_item *dequeue(struct resman_thread_pool *tpool)
+{
+	struct resman_tpool_client *client;
+
+	/* subtasks of jobs which are already running go first */
+	if(tpool->subclient.qsize) {
+		return client_dequeue(&tpool->subclient);
+	}
+
+	/* clients below their guaranteed minimum of workers go first */
+	client = tpool->cur_client;
+	do {
+		if(client->qsize && client->nactive < client->min_workers) {
+			return client_dequeue(client);
+		}
+		client = client->next;
+	} while(client != tpool->cur_client);
+
+	/* deficit round-robin. Clients with nothing queued lose any credit they
+	 * had, so they can't save it up for a burst later.
+	 */
+	for(;;) {
+		client = tpool->cur_client;
+		if(client->qsize && client->deficit > 0) {
+			client->deficit--;
+			return client_dequeue(client);
+		}
+		if(!client->qsize) {
+			client->deficit = 0;
+		}
+		tpool->cur_client = client = client->next;
+		client->deficit += client->weight;
+	}
+}
+
+/* absolute time msec from now, for pthread_cond_timedwait */
+static void abs_timeout(struct timespec *ts, long msec)
+{
+#if defined(WIN32) || defined(__WIN32__)
+	FILETIME ft;
+	unsigned long long usec;
+
+	GetSystemTimeAsFileTime(&ft);
+	/* 100ns intervals since 1601 -> usec since 1970 */
+	usec = (((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10;
+	usec -= 11644473600000000ull;
+	usec += (unsigned long long)msec * 1000;
+	ts->tv_sec = usec / 1000000;
+	ts->tv_nsec = (usec % 1000000) * 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, 0);
+	ts->tv_sec = tv.tv_sec + msec / 1000;
+	ts->tv_nsec = tv.tv_usec * 1000 + (msec % 1000) * 1000000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+#endif
+}
+
+/* CPU time used by a thread in msec, or -1 if it's not available */
+static long thread_cpu_msec(pthread_t thread)
+{
+#if defined(_POSIX_THREAD_CPUTIME) && _POSIX_THREAD_CPUTIME >= 0
+	clockid_t clk;
+	struct timespec ts;
+
+	if(pthread_getcpuclockid(thread, &clk) != 0 || clock_gettime(clk, &ts) == -1) {
+		return -1;
+	}
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	return -1;
+#endif
+}
+
+/* remove the first job of the highest priority non-empty queue of a client.
+ * called with the work queue mutex held, and client->qsize > 0
+ */
+static struct work_item *client_dequeue(struct resman_tpool_client *client)
+{
+	int i;
+	struct work_item *job;
+
+	for(i=RESMAN_TPOOL_NUM_PRIO - 1; i>=0; i--) {
+		if((job = client->workq[i])) {
+			if(!(client->workq[i] = job->next)) {
+				client->workq_tail[i] = 0;
+			}
+			--client->qsize;
+			return job;
+		}
+	}
 	return 0;
 }
 
+/* called with the work queue mutex held */
+static void clear_client(struct resman_tpool_client *client)
+{
+	int i;
+
+	for(i=0; i<RESMAN_TPOOL_NUM_PRIO; i++) {
+		while(client->workq[i]) {
+			struct work_item *tmp = client->workq[i];
+			client->workq[i] = client->workq[i]->next;
+			if(tmp->group) {
+				--tmp->group->pending;
+			}
+			free_work_item(tmp);
+		}
+		client->workq[i] = client->workq_tail[i] = 0;
+	}
+	client->qsize = 0;
+	client->deficit = 0;
+}
+
 
 /* The following highly platform-specific code detects the number
  * of processors available in the system. It's used by the thread pool
@@ -435,38 +1410,25 @@ int resman_tpool_num_processors(void)
 #endif
 }
 
-#define MAX_WPOOL_SIZE	64
-static pthread_mutex_t wpool_lock = PTHREAD_MUTEX_INITIALIZER;
-static struct work_item *wpool;
-static int wpool_size;
+static struct mempool wpool;
+static pthread_once_t wpool_once = PTHREAD_ONCE_INIT;
 
-/* work item allocator */
-static struct work_item *alloc_work_item(void)
+static void init_wpool(void)
 {
-	struct work_item *w;
-
-	pthread_mutex_lock(&wpool_lock);
-	if(!wpool) {
-		pthread_mutex_unlock(&wpool_lock);
-		return malloc(sizeof(struct work_item));
+	if(resman_mempool_init(&wpool, sizeof(struct work_item)) == -1) {
+		fprintf(stderr, "resman_thread_pool: failed to initialize work item allocator\n");
+		abort();
 	}
+}
 
-	w = wpool;
-	wpool = wpool->next;
-	--wpool_size;
-	pthread_mutex_unlock(&wpool_lock);
-	return w;
+/* work item allocator */
+static struct work_item *alloc_work_item(void)
+{
+	pthread_once(&wpool_once, init_wpool);
+	return resman_mempool_alloc(&wpool);
 }
 
 static void free_work_item(struct work_item *w)
 {
-	pthread_mutex_lock(&wpool_lock);
-	if(wpool_size >= MAX_WPOOL_SIZE) {
-		free(w);
-	} else {
-		w->next = wpool;
-		wpool = w;
-		++wpool_size;
-	}
-	pthread_mutex_unlock(&wpool_lock);
+	resman_mempool_free(&wpool, w);
 }
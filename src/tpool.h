@@ -19,9 +19,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define THREADPOOL_H_
 
 struct resman_thread_pool;
+struct resman_tpool_client;
+struct resman_tpool_group;
+struct resman_pool_attr;
+struct resman_pool_stats;
 
 /* type of the function accepted as work or completion callback */
 typedef void (*resman_tpool_callback)(void*);
+/* parallel_for callback: process indices [begin, end) */
+typedef void (*resman_tpool_range_func)(int begin, int end, void *cls);
+
+/* job priority levels. Workers always pick the oldest job of the highest
+ * priority level which has any jobs queued, among the jobs of the client
+ * they're serving (see resman_tpool_add_client).
+ */
+enum {
+	RESMAN_TPOOL_PRIO_LOW,
+	RESMAN_TPOOL_PRIO_NORMAL,
+	RESMAN_TPOOL_PRIO_HIGH,
+	RESMAN_TPOOL_PRIO_URGENT,
+
+	RESMAN_TPOOL_NUM_PRIO
+};
 
 #ifdef __cplusplus
 extern "C" {
@@ -29,6 +48,10 @@ extern "C" {
 
 /* if num_threads == 0, auto-detect how many threads to spawn */
 struct resman_thread_pool *resman_tpool_create(int num_threads);
+/* create a thread pool with the stack size, scheduling class, and CPU affinity
+ * specified in attr (see resman.h). A null attr is the same as the defaults.
+ */
+struct resman_thread_pool *resman_tpool_create_attr(const struct resman_pool_attr *attr);
 void resman_tpool_destroy(struct resman_thread_pool *tpool);
 
 /* optional reference counting interface for thread pool sharing */
@@ -46,6 +69,49 @@ void resman_tpool_end_batch(struct resman_thread_pool *tpool);
  */
 int resman_tpool_enqueue(struct resman_thread_pool *tpool, void *data,
 		resman_tpool_callback work_func, resman_tpool_callback done_func);
+/* same as resman_tpool_enqueue, with a priority level other than normal */
+int resman_tpool_enqueue_prio(struct resman_thread_pool *tpool, int prio, void *data,
+		resman_tpool_callback work_func, resman_tpool_callback done_func);
+/* clients sharing a pool get their own work queues, and workers are divided
+ * between them in proportion to their weights. A client with jobs queued, and
+ * fewer than min_workers of them running, is always served first. Jobs enqueued
+ * without a client, go to a default client with weight 1.
+ * Removing a client discards any of its jobs which haven't started yet.
+ */
+struct resman_tpool_client *resman_tpool_add_client(struct resman_thread_pool *tpool,
+		int weight, int min_workers);
+void resman_tpool_remove_client(struct resman_thread_pool *tpool, struct resman_tpool_client *client);
+void resman_tpool_set_client_share(struct resman_thread_pool *tpool,
+		struct resman_tpool_client *client, int weight, int min_workers);
+int resman_tpool_enqueue_client(struct resman_thread_pool *tpool, struct resman_tpool_client *client,
+		int prio, void *data, resman_tpool_callback work_func, resman_tpool_callback done_func);
+
+/* task groups: jobs enqueued in a group can be waited on together, without
+ * waiting for unrelated jobs in the pool. Groups enqueue their jobs through
+ * the client passed to create_group (or the default client if null).
+ * Destroying a group waits for its pending jobs first. Don't wait on a group
+ * from a worker thread, unless it's certain that other workers are free to
+ * run its jobs.
+ */
+struct resman_tpool_group *resman_tpool_create_group(struct resman_thread_pool *tpool,
+		struct resman_tpool_client *client);
+void resman_tpool_destroy_group(struct resman_tpool_group *group);
+int resman_tpool_enqueue_group(struct resman_tpool_group *group, int prio, void *data,
+		resman_tpool_callback work_func, resman_tpool_callback done_func);
+/* returns the number of queued or running jobs in the group */
+int resman_tpool_group_pending(struct resman_tpool_group *group);
+void resman_tpool_group_wait(struct resman_tpool_group *group);
+/* wait for up to timeout msec, returns the time spent waiting in msec */
+long resman_tpool_group_timedwait(struct resman_tpool_group *group, long timeout);
+
+/* split the range [start, end) in chunks of grain indices (0: automatic), and
+ * process them in parallel, calling func for each chunk. Returns when the whole
+ * range is done. The calling thread processes chunks too, so it's safe to call
+ * from inside a job, even when all the workers are doing the same.
+ */
+int resman_tpool_parallel_for(struct resman_thread_pool *tpool, int start, int end, int grain,
+		resman_tpool_range_func func, void *cls);
+
 /* clear the work queue. does not cancel any currently running jobs */
 void resman_tpool_clear(struct resman_thread_pool *tpool);
 
@@ -81,6 +147,14 @@ int resman_tpool_get_wait_fd(struct resman_thread_pool *tpool);
  */
 void *resman_tpool_get_wait_handle(struct resman_thread_pool *tpool);
 
+/* wake up anyone waiting for job completion events on the wait fd/handle,
+ * without completing a job. Useful for signalling progress from a worker.
+ */
+void resman_tpool_notify(struct resman_thread_pool *tpool);
+
+/* current size of the pool, and job counts */
+int resman_tpool_get_stats(struct resman_thread_pool *tpool, struct resman_pool_stats *stats);
+
 /* returns the number of processors on the system.
  * individual cores in multi-core processors are counted as processors.
  */
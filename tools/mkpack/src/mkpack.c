@@ -0,0 +1,323 @@
+/*
+mkpack - builds libresman pack files out of directory trees.
+Copyright (C) 2014-2019  John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "pack.h"
+
+struct file {
+	char *name;		/* entry name stored in the pack */
+	char *path;		/* path of the source file */
+	uint64_t size;
+};
+
+static int add_dir(const char *path, const char *name);
+static int add_file(const char *path, const char *name, uint64_t size);
+static int write_pack(const char *fname);
+static int copy_data(FILE *out, struct file *f);
+static int pad(FILE *out, uint64_t *offs, uint64_t align);
+static int cmp_files(const void *a, const void *b);
+static int parse_args(int argc, char **argv);
+
+static const char *outfile = "out.pak";
+static const char *prefix = "";
+static int verbose;
+
+static struct file *files;
+static int num_files, max_files;
+
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	if(parse_args(argc, argv) == -1) {
+		return 1;
+	}
+
+	if(!num_files) {
+		fprintf(stderr, "no input files\n");
+		return 1;
+	}
+	qsort(files, num_files, sizeof *files, cmp_files);
+
+	for(i=1; i<num_files; i++) {
+		if(strcmp(files[i - 1].name, files[i].name) == 0) {
+			fprintf(stderr, "duplicate entry: %s (%s and %s)\n", files[i].name,
+					files[i - 1].path, files[i].path);
+			return 1;
+		}
+	}
+
+	if(write_pack(outfile) == -1) {
+		remove(outfile);
+		return 1;
+	}
+	printf("wrote %d files to %s\n", num_files, outfile);
+	return 0;
+}
+
+static int add_dir(const char *path, const char *name)
+{
+	DIR *dir;
+	struct dirent *dent;
+	struct stat st;
+	char *fpath, *fname;
+	int res = 0;
+
+	if(!(dir = opendir(path))) {
+		fprintf(stderr, "failed to open directory: %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	while((dent = readdir(dir))) {
+		if(strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+			continue;
+		}
+
+		fpath = malloc(strlen(path) + strlen(dent->d_name) + 2);
+		fname = malloc(strlen(name) + strlen(dent->d_name) + 2);
+		if(!fpath || !fname) {
+			perror("failed to allocate path");
+			free(fpath);
+			free(fname);
+			res = -1;
+			break;
+		}
+		sprintf(fpath, "%s/%s", path, dent->d_name);
+		if(*name) {
+			sprintf(fname, "%s/%s", name, dent->d_name);
+		} else {
+			strcpy(fname, dent->d_name);
+		}
+
+		if(stat(fpath, &st) == -1) {
+			fprintf(stderr, "failed to stat %s: %s\n", fpath, strerror(errno));
+		} else if(S_ISDIR(st.st_mode)) {
+			res = add_dir(fpath, fname);
+		} else if(S_ISREG(st.st_mode)) {
+			res = add_file(fpath, fname, st.st_size);
+		}
+		free(fpath);
+		free(fname);
+
+		if(res == -1) break;
+	}
+	closedir(dir);
+	return res;
+}
+
+static int add_file(const char *path, const char *name, uint64_t size)
+{
+	struct file *f;
+
+	if(num_files >= max_files) {
+		int newsz = max_files ? max_files * 2 : 64;
+		if(!(f = realloc(files, newsz * sizeof *files))) {
+			perror("failed to resize file list");
+			return -1;
+		}
+		files = f;
+		max_files = newsz;
+	}
+	f = files + num_files;
+
+	if(!(f->name = malloc(strlen(prefix) + strlen(name) + 1)) || !(f->path = strdup(path))) {
+		perror("failed to allocate file entry");
+		free(f->name);
+		return -1;
+	}
+	strcpy(f->name, prefix);
+	strcat(f->name, name);
+	f->size = size;
+
+	num_files++;
+	return 0;
+}
+
+static int write_pack(const char *fname)
+{
+	int i;
+	FILE *out;
+	struct pack_header hdr;
+	struct pack_entry *toc;
+	uint64_t offs, name_offs;
+
+	if(!(toc = calloc(num_files, sizeof *toc))) {
+		perror("failed to allocate entry table");
+		return -1;
+	}
+
+	memcpy(hdr.magic, PACK_MAGIC, PACK_MAGIC_SIZE);
+	hdr.num_entries = num_files;
+	hdr.toc_offs = sizeof hdr;
+	hdr.strtab_offs = hdr.toc_offs + num_files * sizeof *toc;
+
+	/* lay out the string table, and then the file data after it */
+	name_offs = 0;
+	for(i=0; i<num_files; i++) {
+		toc[i].name_offs = name_offs;
+		toc[i].name_len = strlen(files[i].name);
+		name_offs += toc[i].name_len + 1;
+	}
+	hdr.strtab_size = name_offs;
+
+	offs = hdr.strtab_offs + hdr.strtab_size;
+	for(i=0; i<num_files; i++) {
+		offs = (offs + PACK_DATA_ALIGN - 1) & ~(uint64_t)(PACK_DATA_ALIGN - 1);
+		toc[i].data_offs = offs;
+		toc[i].data_size = files[i].size;
+		offs += files[i].size;
+	}
+
+	if(!(out = fopen(fname, "wb"))) {
+		fprintf(stderr, "failed to open %s for writing: %s\n", fname, strerror(errno));
+		free(toc);
+		return -1;
+	}
+
+	fwrite(&hdr, sizeof hdr, 1, out);
+	fwrite(toc, sizeof *toc, num_files, out);
+	for(i=0; i<num_files; i++) {
+		fwrite(files[i].name, 1, toc[i].name_len + 1, out);
+	}
+
+	offs = hdr.strtab_offs + hdr.strtab_size;
+	for(i=0; i<num_files; i++) {
+		if(pad(out, &offs, PACK_DATA_ALIGN) == -1 || copy_data(out, files + i) == -1) {
+			goto err;
+		}
+		offs += files[i].size;
+		if(verbose) {
+			printf("  %s (%lu bytes)\n", files[i].name, (unsigned long)files[i].size);
+		}
+	}
+
+	if(fclose(out) == EOF) {
+		fprintf(stderr, "failed to write %s: %s\n", fname, strerror(errno));
+		free(toc);
+		return -1;
+	}
+	free(toc);
+	return 0;
+
+err:
+	fclose(out);
+	free(toc);
+	return -1;
+}
+
+static int copy_data(FILE *out, struct file *f)
+{
+	FILE *in;
+	char buf[16384];
+	size_t sz;
+	uint64_t total = 0;
+
+	if(!(in = fopen(f->path, "rb"))) {
+		fprintf(stderr, "failed to open %s: %s\n", f->path, strerror(errno));
+		return -1;
+	}
+	while((sz = fread(buf, 1, sizeof buf, in)) > 0) {
+		if(fwrite(buf, 1, sz, out) < sz) {
+			fprintf(stderr, "failed to write %s: %s\n", outfile, strerror(errno));
+			fclose(in);
+			return -1;
+		}
+		total += sz;
+	}
+	fclose(in);
+
+	if(total != f->size) {
+		fprintf(stderr, "%s changed size while packing\n", f->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int pad(FILE *out, uint64_t *offs, uint64_t align)
+{
+	while(*offs & (align - 1)) {
+		if(fputc(0, out) == EOF) {
+			return -1;
+		}
+		++*offs;
+	}
+	return 0;
+}
+
+/* entries must be sorted with strcmp, to match the lookup in pack.c */
+static int cmp_files(const void *a, const void *b)
+{
+	return strcmp(((struct file*)a)->name, ((struct file*)b)->name);
+}
+
+static const char *usage_fmt = "Usage: %s [options] <dir> [<dir> ...]\n"
+	"Options:\n"
+	"  -o <file>    output pack file (default: out.pak)\n"
+	"  -p <prefix>  prepend prefix to all entry names (e.g. \"data/\")\n"
+	"  -v           verbose output\n"
+	"  -h           print usage and exit\n";
+
+static int parse_args(int argc, char **argv)
+{
+	int i;
+
+	for(i=1; i<argc; i++) {
+		if(argv[i][0] == '-' && argv[i][1] && argv[i][2] == 0) {
+			switch(argv[i][1]) {
+			case 'o':
+				if(!argv[++i]) {
+					fprintf(stderr, "-o must be followed by the output filename\n");
+					return -1;
+				}
+				outfile = argv[i];
+				break;
+
+			case 'p':
+				if(!argv[++i]) {
+					fprintf(stderr, "-p must be followed by a prefix\n");
+					return -1;
+				}
+				prefix = argv[i];
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			case 'h':
+				printf(usage_fmt, argv[0]);
+				exit(0);
+
+			default:
+				fprintf(stderr, "invalid option: %s\n", argv[i]);
+				fprintf(stderr, usage_fmt, argv[0]);
+				return -1;
+			}
+		} else {
+			if(add_dir(argv[i], "") == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}